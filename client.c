@@ -39,6 +39,7 @@
 
 #include "malloc.h"
 #include "zombieland.h"
+#include "packet.h"
 #include "gui.h"
 
 
@@ -349,12 +350,16 @@ main (int argc, char *argv[])
   struct sockaddr_in local_addr, server_addr, recv_addr;
   ssize_t recvlen;
   socklen_t recv_addr_len = sizeof (recv_addr);
-  uint16_t portoff = 0, tmp;
+  socklen_t local_addr_len = sizeof (local_addr);
   struct hostent *server;
 
+  unsigned char packet [MAX_DATAGRAM_SIZE];
   struct message msg, *state, buf1, buf2, *buf, *latest_srv_state = NULL;
+  struct snapshot *history, *snap;
+  struct reassembly *reasm;
+  int ret;
 
-  uint32_t id, latest_update = 0;
+  uint32_t id, token, latest_update = 0, snapshots_received = 0;
 
   enum player_action controls [SDL_NUM_SCANCODES] = {0};
 
@@ -610,24 +615,17 @@ main (int argc, char *argv[])
   local_addr.sin_family = AF_INET;
   local_addr.sin_addr.s_addr = INADDR_ANY;
 
-  while (portoff < 16)
-    {
-      local_addr.sin_port = htons (ZOMBIELAND_PORT+portoff);
-
-      if (!bind (sockfd, (struct sockaddr *) &local_addr, sizeof (local_addr)))
-	break;
+  local_addr.sin_port = 0;
 
-      portoff++;
-    }
-
-  if (portoff == 16)
+  if (bind (sockfd, (struct sockaddr *) &local_addr, sizeof (local_addr)) < 0
+      || getsockname (sockfd, (struct sockaddr *) &local_addr,
+		      &local_addr_len) < 0)
     {
-      fprintf (stderr, "could not bind socket, maybe another program is bound to "
-	       "the same port?\n");
+      fprintf (stderr, "could not bind socket\n");
       return 1;
     }
 
-  printf ("listening on port %d...\n", ZOMBIELAND_PORT+portoff);
+  printf ("listening on port %d...\n", ntohs (local_addr.sin_port));
 
   server = gethostbyname (servername);
 
@@ -643,24 +641,16 @@ main (int argc, char *argv[])
 	 server->h_length);
   server_addr.sin_port = htons (ZOMBIELAND_PORT);
 
-  bzero ((char *) &msg, sizeof (msg));
-  msg.type = htonl (MSG_LOGIN);
-  tmp = htons (portoff);
-  memcpy (&msg.args.login.portoff, &tmp, sizeof (tmp));
+  msg.type = MSG_LOGIN;
   strcpy (msg.args.login.logname, playername);
-  msg.args.login.bodytype = htonl (bodytype);
+  msg.args.login.bodytype = bodytype;
 
   printf ("contacting server %s... ", servername);
   fflush (stdout);
 
-  if (sendto (sockfd, (char *)&msg, sizeof (msg), 0,
-	      (struct sockaddr *) &server_addr, sizeof (server_addr)) < 0)
-    {
-      fprintf (stderr, "could not send data to server\n");
-      return 1;
-    }
+  send_message (sockfd, &server_addr, &msg);
 
-  recvlen = recvfrom (sockfd, (char *)&msg, sizeof (msg), 0,
+  recvlen = recvfrom (sockfd, packet, sizeof (packet), 0,
 		      (struct sockaddr *) &recv_addr, &recv_addr_len);
 
   if (recvlen < 0)
@@ -669,18 +659,17 @@ main (int argc, char *argv[])
       return 1;
     }
 
-  if (recvlen < 5)
+  if (decode_message (packet, recvlen, NULL, &msg) < 0)
     {
-      fprintf (stderr, "got a message too short from server\n");
+      fprintf (stderr, "got a malformed message from server\n");
       return 1;
     }
 
-  msg.type = ntohl (msg.type);
-
   switch (msg.type)
     {
     case MSG_LOGINOK:
-      id = ntohl (msg.args.loginok.id);
+      id = msg.args.loginok.id;
+      token = msg.args.loginok.token;
       printf ("got id %d\n", id);
       break;
     case MSG_LOGNAME_IN_USE:
@@ -697,6 +686,11 @@ main (int argc, char *argv[])
     }
 
 
+  history = calloc_and_check (SNAPSHOT_HISTORY, sizeof (*history));
+  reasm = malloc_and_check (sizeof (*reasm));
+  init_reassembly (reasm);
+
+
   if (SDL_Init (SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
     {
       fprintf (stderr, "could not initialise SDL: %s\n", SDL_GetError ());
@@ -1086,10 +1080,22 @@ main (int argc, char *argv[])
 	  if (loc_char_speed_x || loc_char_speed_y)
 	    do_interact = 0;
 
-	  send_message (sockfd, &server_addr, -1, MSG_CLIENT_CHAR_STATE, id, fc,
-			loc_char_speed_x, loc_char_speed_y, loc_char_facing,
-			do_interact, do_shoot, do_stab, do_search, bagswap1,
-			bagswap2);
+	  msg.type = MSG_CLIENT_CHAR_STATE;
+	  msg.args.client_char_state.id = id;
+	  msg.args.client_char_state.token = token;
+	  msg.args.client_char_state.received = snapshots_received;
+	  msg.args.client_char_state.frame_counter = fc;
+	  msg.args.client_char_state.ack_frame = latest_update;
+	  msg.args.client_char_state.char_speed_x = loc_char_speed_x;
+	  msg.args.client_char_state.char_speed_y = loc_char_speed_y;
+	  msg.args.client_char_state.char_facing = loc_char_facing;
+	  msg.args.client_char_state.do_interact = do_interact;
+	  msg.args.client_char_state.do_shoot = do_shoot;
+	  msg.args.client_char_state.do_stab = do_stab;
+	  msg.args.client_char_state.do_search = do_search;
+	  msg.args.client_char_state.swap [0] = bagswap1;
+	  msg.args.client_char_state.swap [1] = bagswap2;
+	  send_message (sockfd, &server_addr, &msg);
 
 	  if (do_interact)
 	    do_interact--;
@@ -1114,7 +1120,7 @@ main (int argc, char *argv[])
 	{
 	  buf = &buf1 == latest_srv_state ? &buf2 : &buf1;
 
-	  recvlen = recvfrom (sockfd, buf, MAXMSGSIZE, MSG_DONTWAIT,
+	  recvlen = recvfrom (sockfd, packet, sizeof (packet), MSG_DONTWAIT,
 			      (struct sockaddr *) &recv_addr, &recv_addr_len);
 	  state = buf;
 
@@ -1127,22 +1133,46 @@ main (int argc, char *argv[])
 	      return 1;
 	    }
 
-	  if (recvlen < 5)
+	  if (recvlen && packet [0] == MSG_FRAGMENT)
 	    {
-	      fprintf (stderr, "got a message too short from server\n");
-	      return 1;
+	      ret = add_fragment (reasm, packet, recvlen);
+
+	      if (!ret)
+		continue;
+
+	      if (ret > 0)
+		ret = decode_message (reasm->data, reasm->len, history, state);
 	    }
+	  else
+	    ret = decode_message (packet, recvlen, history, state);
 
+	  if ((!ret || ret == DECODE_NO_BASELINE)
+	      && state->type == MSG_SERVER_STATE)
+	    snapshots_received++;
 
-	  state->type = ntohl (state->type);
+	  if (ret == DECODE_NO_BASELINE)
+	    continue;
+
+	  if (ret < 0)
+	    {
+	      fprintf (stderr, "got a malformed message from server\n");
+	      continue;
+	    }
 
 	  switch (state->type)
 	    {
 	    case MSG_SERVER_STATE:
+	      snap = &history [state->args.server_state.frame_counter
+			       % SNAPSHOT_HISTORY];
+	      snap->frame = state->args.server_state.frame_counter;
+	      snap->num_visibles = state->args.server_state.num_visibles;
+	      memcpy (snap->visibles, state->args.server_state.visibles,
+		      sizeof (struct visible) * snap->num_visibles);
+
 	      if (!latest_srv_state ||
-		  latest_update < ntohl (state->args.server_state.frame_counter))
+		  latest_update < state->args.server_state.frame_counter)
 		{
-		  latest_update = ntohl (state->args.server_state.frame_counter);
+		  latest_update = state->args.server_state.frame_counter;
 		  latest_srv_state = buf;
 		  latest_update_ticks = fc;
 		}
@@ -1196,7 +1226,7 @@ main (int argc, char *argv[])
 
 	  while (ar)
 	    {
-	      if (ar->id == ntohl (state->args.server_state.areaid))
+	      if (ar->id == state->args.server_state.areaid)
 		{
 		  area = ar;
 		  break;
@@ -1212,41 +1242,41 @@ main (int argc, char *argv[])
 	      return 1;
 	    }
 
-	  if ((character_box.x != ntohl (state->args.server_state.x)
-	       || character_box.y != ntohl (state->args.server_state.y))
+	  if ((character_box.x != state->args.server_state.x
+	       || character_box.y != state->args.server_state.y)
 	      && textlines)
 	    {
 	      textlines = 0;
 	    }
 
-	  character_box.x = ntohl (state->args.server_state.x);
-	  character_box.y = ntohl (state->args.server_state.y);
-	  character_box.w = ntohl (state->args.server_state.w);
-	  character_box.h = ntohl (state->args.server_state.h);
+	  character_box.x = state->args.server_state.x;
+	  character_box.y = state->args.server_state.y;
+	  character_box.w = state->args.server_state.w;
+	  character_box.h = state->args.server_state.h;
 	  srv_char_facing = state->args.server_state.char_facing;
 
-	  if (ntohl (state->args.server_state.life) > life)
+	  if (state->args.server_state.life > life)
 	    Mix_PlayChannel (-1, healsfx, 0);
 
-	  life = ntohl (state->args.server_state.life);
+	  life = state->args.server_state.life;
 	  is_immortal = state->args.server_state.is_immortal;
 
-	  if (ntohl (state->args.server_state.bullets) > bullets)
+	  if (state->args.server_state.bullets > bullets)
 	    Mix_PlayChannel (-1, reloadsfx, 0);
 
-	  bullets = ntohl (state->args.server_state.bullets);
+	  bullets = state->args.server_state.bullets;
 
-	  if (ntohl (state->args.server_state.hunger) < hunger)
+	  if (state->args.server_state.hunger < hunger)
 	    Mix_PlayChannel (-1, eatsfx, 0);
 
-	  hunger = ntohl (state->args.server_state.hunger);
+	  hunger = state->args.server_state.hunger;
 
-	  if (ntohl (state->args.server_state.thirst) < thirst)
+	  if (state->args.server_state.thirst < thirst)
 	    Mix_PlayChannel (-1, drinksfx, 0);
 
-	  thirst = ntohl (state->args.server_state.thirst);
+	  thirst = state->args.server_state.thirst;
 
-	  num_visibles = ntohl (state->args.server_state.num_visibles);
+	  num_visibles = state->args.server_state.num_visibles;
 
 
 	  if (state->args.server_state.just_shot && frame_counter-just_shot>100)
@@ -1326,13 +1356,12 @@ main (int argc, char *argv[])
 	  for (i = 0; i < num_visibles; i++)
 	    {
 	      vis = state->args.server_state.visibles [i];
-	      vis.type = ntohl (vis.type);
 
 	      if (vis.type < VISIBLE_HEALTH || vis.type > VISIBLE_FLESH)
 		continue;
 
-	      pers.x = (-camera_src.x + area->walkable.x + ntohl (vis.x))*scaling;
-	      pers.y = (-camera_src.y + area->walkable.y + ntohl (vis.y))*scaling;
+	      pers.x = (-camera_src.x + area->walkable.x + vis.x)*scaling;
+	      pers.y = (-camera_src.y + area->walkable.y + vis.y)*scaling;
 	      pers.w = GRID_CELL_W*scaling;
 	      pers.h = GRID_CELL_H*scaling;
 	      SDL_RenderCopy (rend, objectstxtr,
@@ -1346,14 +1375,13 @@ main (int argc, char *argv[])
 	  for (i = 0; i < num_visibles; i++)
 	    {
 	      vis = state->args.server_state.visibles [i];
-	      vis.type = ntohl (vis.type);
 
 	      if (vis.type != VISIBLE_ZOMBIE)
 		continue;
 
-	      pers.x = (-camera_src.x + area->walkable.x + ntohl (vis.x)
+	      pers.x = (-camera_src.x + area->walkable.x + vis.x
 			+ zombie_origin.x)*scaling;
-	      pers.y = (-camera_src.y + area->walkable.y + ntohl (vis.y)
+	      pers.y = (-camera_src.y + area->walkable.y + vis.y
 			+ zombie_origin.y)*scaling;
 
 	      if (vis.is_immortal)
@@ -1378,7 +1406,7 @@ main (int argc, char *argv[])
 	      zombierects = vis.subtype == ZOMBIE_WALKER ? zombie_srcs : blob_srcs;
 
 	      SDL_RenderCopy (rend, vis.subtype == ZOMBIE_WALKER ? zombietxtr : blobtxtr,
-			      &zombierects [ntohl (vis.facing)*3+
+			      &zombierects [vis.facing*3+
 					    ((vis.speed_x || vis.speed_y)
 					     ? 1+(frame_counter%400)/200 : 0)],
 			      &pers);
@@ -1387,8 +1415,6 @@ main (int argc, char *argv[])
 	  for (i = 0; i < num_visibles; i++)
 	    {
 	      vis = state->args.server_state.visibles [i];
-	      vis.type = ntohl (vis.type);
-	      vis.subtype = ntohl (vis.subtype);
 
 	      if (vis.subtype < 0 || vis.subtype > 6)
 		vis.subtype = 0;
@@ -1396,15 +1422,15 @@ main (int argc, char *argv[])
 	      if (vis.type != VISIBLE_PLAYER)
 		continue;
 
-	      pers.x = (-camera_src.x + area->walkable.x + ntohl (vis.x)
+	      pers.x = (-camera_src.x + area->walkable.x + vis.x
 			+ character_origin [vis.subtype].x)*scaling;
-	      pers.y = (-camera_src.y + area->walkable.y + ntohl (vis.y)
+	      pers.y = (-camera_src.y + area->walkable.y + vis.y
 			+ character_origin [vis.subtype].y)*scaling;
 	      pers.w = character_origin [vis.subtype].w*scaling;
 	      pers.h = character_origin [vis.subtype].h*scaling;
 	      SDL_RenderCopy (rend, charactertxtr,
 			      &character_srcs [vis.subtype*12
-					       +ntohl (vis.facing)*3+
+					       +vis.facing*3+
 					       ((vis.speed_x || vis.speed_y)
 						? 1+(frame_counter%400)/200 : 0)],
 			      &pers);
@@ -1429,14 +1455,13 @@ main (int argc, char *argv[])
 	  for (i = 0; i < num_visibles; i++)
 	    {
 	      vis = state->args.server_state.visibles [i];
-	      vis.type = ntohl (vis.type);
 
 	      if (vis.type != VISIBLE_SEARCHABLE
 		  && vis.type != VISIBLE_SEARCHING)
 		continue;
 
-	      pers.x = (-camera_src.x + area->walkable.x + ntohl (vis.x))*scaling;
-	      pers.y = (-camera_src.y + area->walkable.y + ntohl (vis.y))*scaling;
+	      pers.x = (-camera_src.x + area->walkable.x + vis.x)*scaling;
+	      pers.y = (-camera_src.y + area->walkable.y + vis.y)*scaling;
 	      pers.w = GRID_CELL_W*scaling;
 	      pers.h = GRID_CELL_H*scaling;
 	      SDL_RenderCopy (rend, objectstxtr,
@@ -1463,16 +1488,15 @@ main (int argc, char *argv[])
 	  for (i = 0; i < num_visibles; i++)
 	    {
 	      vis = state->args.server_state.visibles [i];
-	      vis.type = ntohl (vis.type);
 
 	      if (vis.type != VISIBLE_SHOT)
 		continue;
 
-	      sh.x = (-camera_src.x + area->walkable.x + ntohl (vis.x))*scaling;
-	      sh.y = (-camera_src.y + area->walkable.y + ntohl (vis.y))*scaling;
+	      sh.x = (-camera_src.x + area->walkable.x + vis.x)*scaling;
+	      sh.y = (-camera_src.y + area->walkable.y + vis.y)*scaling;
 	      sh.w = GRID_CELL_W*scaling;
 	      sh.h = GRID_CELL_H*scaling;
-	      SDL_RenderCopy (rend, objectstxtr, ntohl (vis.duration) > 5 ? &shot1_src
+	      SDL_RenderCopy (rend, objectstxtr, vis.duration > 5 ? &shot1_src
 			      : &shot2_src, &sh);
 	    }
 
@@ -1481,12 +1505,12 @@ main (int argc, char *argv[])
 	      do_interact = 0;
 
 	      strcpy (textbox, state->args.server_state.textbox);
-	      textlines = ntohl (state->args.server_state.textbox_lines_num);
+	      textlines = state->args.server_state.textbox_lines_num;
 	      textcursor = 0;
 
-	      if ((int32_t) ntohl (state->args.server_state.npcid) >= 0)
+	      if (state->args.server_state.npcid >= 0)
 		{
-		  area->npcs [ntohl (state->args.server_state.npcid)].facing
+		  area->npcs [state->args.server_state.npcid].facing
 		    = loc_char_facing == FACING_DOWN ? FACING_UP
 		    : loc_char_facing == FACING_UP ? FACING_DOWN
 		    : loc_char_facing == FACING_RIGHT ? FACING_LEFT
@@ -1556,7 +1580,7 @@ main (int argc, char *argv[])
 	      if (!is_searching)
 		{
 		  bagcursor = 0, bagswap1 = -1, bagswap2 = -1;
-		  is_searching = ntohl (state->args.server_state.is_searching);
+		  is_searching = state->args.server_state.is_searching;
 		}
 
 	      SDL_RenderCopy (rend, bagtxtr,
@@ -1565,7 +1589,7 @@ main (int argc, char *argv[])
 
 	      for (i = 0; i < BAG_SIZE*is_searching; i++)
 		{
-		  switch (ntohl (state->args.server_state.bag [i]))
+		  switch (state->args.server_state.bag [i])
 		    {
 		    case OBJECT_HEALTH:
 		      SDL_RenderCopy (rend, objectstxtr, &healthobjrect,
@@ -1603,7 +1627,7 @@ main (int argc, char *argv[])
 		  SDL_RenderCopy (rend, bagtxtr, &bagswapsrc, &bagcursordest);
 		}
 
-	      display_string (objcaptions [ntohl (state->args.server_state.bag [bagcursor])],
+	      display_string (objcaptions [state->args.server_state.bag [bagcursor]],
 			      objcaptionrect, hudfont, textcol, rend);
 	    }
 	  else
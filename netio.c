@@ -0,0 +1,628 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "config.h"
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#if defined (HAVE_EPOLL_CREATE1) && defined (HAVE_TIMERFD_CREATE)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+#include <netinet/in.h>
+
+#include <SDL2/SDL_ttf.h>
+
+#include "malloc.h"
+#include "zombieland.h"
+#include "packet.h"
+#include "netio.h"
+
+
+
+void
+get_monotonic_time (struct timespec *t)
+{
+  if (clock_gettime (CLOCK_MONOTONIC, t) < 0)
+    {
+      fprintf (stderr, "could not read the monotonic clock\n");
+      exit (1);
+    }
+}
+
+
+void
+add_nanoseconds (struct timespec *t, long ns)
+{
+  t->tv_nsec += ns;
+
+  while (t->tv_nsec >= 1000000000L)
+    {
+      t->tv_sec++;
+      t->tv_nsec -= 1000000000L;
+    }
+}
+
+
+long long
+nanoseconds_between (const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000000000LL
+    + (to->tv_nsec - from->tv_nsec);
+}
+
+
+void
+init_event_loop (struct event_loop *loop, int fd)
+{
+  loop->fd = fd;
+
+#if defined (HAVE_EPOLL_CREATE1) && defined (HAVE_TIMERFD_CREATE)
+  struct epoll_event ev = {0};
+
+  loop->epollfd = epoll_create1 (0);
+  loop->timerfd = timerfd_create (CLOCK_MONOTONIC, 0);
+
+  if (loop->epollfd < 0 || loop->timerfd < 0)
+    {
+      fprintf (stderr, "could not set up the event loop\n");
+      exit (1);
+    }
+
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+
+  if (epoll_ctl (loop->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+      fprintf (stderr, "could not set up the event loop\n");
+      exit (1);
+    }
+
+  ev.data.fd = loop->timerfd;
+
+  if (epoll_ctl (loop->epollfd, EPOLL_CTL_ADD, loop->timerfd, &ev) < 0)
+    {
+      fprintf (stderr, "could not set up the event loop\n");
+      exit (1);
+    }
+
+  loop->armed.tv_sec = loop->armed.tv_nsec = 0;
+#endif
+}
+
+
+static void
+drain_wakeups (int fd)
+{
+  char buf [64];
+
+  while (read (fd, buf, sizeof (buf)) > 0);
+}
+
+
+/* returns 1 if the descriptor became readable, 0 if the deadline passed
+   first.  The descriptor must be the non-blocking read end of a wakeup
+   pipe, which is emptied here.  The deadline wins when both are ready, so
+   that a steady stream of input cannot hold back the next tick */
+int
+wait_for_input (struct event_loop *loop, const struct timespec *deadline)
+{
+#if defined (HAVE_EPOLL_CREATE1) && defined (HAVE_TIMERFD_CREATE)
+  struct epoll_event evs [2];
+  struct itimerspec spec = {0};
+  uint64_t expirations;
+  int n, i, readable;
+
+  if (loop->armed.tv_sec != deadline->tv_sec
+      || loop->armed.tv_nsec != deadline->tv_nsec)
+    {
+      spec.it_value = *deadline;
+
+      if (timerfd_settime (loop->timerfd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+	{
+	  fprintf (stderr, "could not arm the tick timer\n");
+	  exit (1);
+	}
+
+      loop->armed = *deadline;
+    }
+
+  while ((n = epoll_wait (loop->epollfd, evs, 2, -1)) < 0)
+    {
+      if (errno != EINTR)
+	{
+	  fprintf (stderr, "could not poll socket\n");
+	  exit (1);
+	}
+    }
+
+  readable = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      if (evs [i].data.fd == loop->timerfd)
+	{
+	  if (read (loop->timerfd, &expirations, sizeof (expirations)) < 0
+	      && errno != EAGAIN)
+	    {
+	      fprintf (stderr, "could not read the tick timer\n");
+	      exit (1);
+	    }
+
+	  loop->armed.tv_sec = loop->armed.tv_nsec = 0;
+	  return 0;
+	}
+
+      readable = 1;
+    }
+
+  if (readable)
+    drain_wakeups (loop->fd);
+
+  return readable;
+#else
+  struct timespec now, timeout;
+  long long left;
+  fd_set fdset;
+  int ret;
+
+  get_monotonic_time (&now);
+  left = nanoseconds_between (&now, deadline);
+
+  if (left <= 0)
+    return 0;
+
+  timeout.tv_sec = left / 1000000000LL;
+  timeout.tv_nsec = left % 1000000000LL;
+
+  FD_ZERO (&fdset);
+  FD_SET (loop->fd, &fdset);
+
+  ret = pselect (loop->fd+1, &fdset, NULL, NULL, &timeout, NULL);
+
+  if (ret < 0 && errno == EINTR)
+    return 1;
+
+  if (ret < 0)
+    {
+      fprintf (stderr, "could not poll socket\n");
+      exit (1);
+    }
+
+  if (ret > 0)
+    drain_wakeups (loop->fd);
+
+  return ret > 0;
+#endif
+}
+
+
+void
+init_datagram_batch (struct datagram_batch *batch, int size)
+{
+  batch->datagrams = calloc_and_check (size, sizeof (*batch->datagrams));
+  batch->size = size;
+  batch->num = 0;
+
+#if defined (HAVE_RECVMMSG) || defined (HAVE_SENDMMSG)
+  int i;
+
+  batch->headers = calloc_and_check (size, sizeof (*batch->headers));
+  batch->iovecs = calloc_and_check (size, sizeof (*batch->iovecs));
+
+  for (i = 0; i < size; i++)
+    {
+      batch->iovecs [i].iov_base = batch->datagrams [i].data;
+      batch->headers [i].msg_hdr.msg_iov = &batch->iovecs [i];
+      batch->headers [i].msg_hdr.msg_iovlen = 1;
+      batch->headers [i].msg_hdr.msg_name = &batch->datagrams [i].addr;
+    }
+#endif
+}
+
+
+/* blocks until at least one datagram arrives, then takes as many as are
+   already waiting, up to the size of the batch.  Returns how many were
+   received, possibly 0 if interrupted by a signal */
+int
+receive_datagrams (int sockfd, struct datagram_batch *batch)
+{
+  int ret;
+
+#ifdef HAVE_RECVMMSG
+  int i;
+
+  for (i = 0; i < batch->size; i++)
+    {
+      batch->iovecs [i].iov_len = sizeof (batch->datagrams [i].data);
+      batch->headers [i].msg_hdr.msg_namelen = sizeof (batch->datagrams [i].addr);
+    }
+
+  ret = recvmmsg (sockfd, batch->headers, batch->size, MSG_WAITFORONE, NULL);
+
+  for (i = 0; i < ret; i++)
+    batch->datagrams [i].len = batch->headers [i].msg_len;
+#else
+  socklen_t addrlen;
+  ssize_t len;
+
+  for (ret = 0; ret < batch->size; ret++)
+    {
+      addrlen = sizeof (batch->datagrams [ret].addr);
+      len = recvfrom (sockfd, batch->datagrams [ret].data,
+		      sizeof (batch->datagrams [ret].data),
+		      ret ? MSG_DONTWAIT : 0,
+		      (struct sockaddr *) &batch->datagrams [ret].addr, &addrlen);
+
+      if (len < 0)
+	break;
+
+      batch->datagrams [ret].len = len;
+    }
+
+  if (!ret)
+    ret = -1;
+#endif
+
+  if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+      fprintf (stderr, "could not receive data from the clients\n");
+      exit (1);
+    }
+
+  return ret < 0 ? 0 : ret;
+}
+
+
+/* returns an empty datagram at the end of the batch, to be filled by the
+   caller and sent by flush_datagrams */
+struct datagram *
+queue_datagram (int sockfd, struct datagram_batch *batch)
+{
+  if (batch->num == batch->size)
+    flush_datagrams (sockfd, batch);
+
+  return &batch->datagrams [batch->num++];
+}
+
+
+/* queues the encoded message msg for addr, split into fragments of frame
+   if it doesn't fit in one datagram */
+void
+queue_encoded_message (int sockfd, struct datagram_batch *batch,
+		       const struct sockaddr_in *addr,
+		       const unsigned char *msg, size_t len, uint32_t frame)
+{
+  struct datagram *dgram;
+  int i, count;
+
+  if (len <= MAX_DATAGRAM_SIZE)
+    {
+      dgram = queue_datagram (sockfd, batch);
+      memcpy (dgram->data, msg, len);
+      dgram->len = len;
+      dgram->addr = *addr;
+      return;
+    }
+
+  count = count_fragments (len);
+
+  for (i = 0; i < count; i++)
+    {
+      dgram = queue_datagram (sockfd, batch);
+      dgram->len = encode_fragment (msg, len, frame, i, dgram->data);
+      dgram->addr = *addr;
+    }
+}
+
+
+void
+flush_datagrams (int sockfd, struct datagram_batch *batch)
+{
+  int sent = 0, ret;
+
+#ifdef HAVE_SENDMMSG
+  int i;
+
+  for (i = 0; i < batch->num; i++)
+    {
+      batch->iovecs [i].iov_len = batch->datagrams [i].len;
+      batch->headers [i].msg_hdr.msg_namelen = sizeof (batch->datagrams [i].addr);
+    }
+
+  while (sent < batch->num)
+    {
+      ret = sendmmsg (sockfd, batch->headers+sent, batch->num-sent, 0);
+
+      if (ret < 0)
+	break;
+
+      sent += ret;
+    }
+#else
+  for (; sent < batch->num; sent++)
+    {
+      ret = sendto (sockfd, batch->datagrams [sent].data,
+		    batch->datagrams [sent].len, 0,
+		    (struct sockaddr *) &batch->datagrams [sent].addr,
+		    sizeof (batch->datagrams [sent].addr));
+
+      if (ret < 0)
+	break;
+    }
+#endif
+
+  if (sent < batch->num)
+    {
+      fprintf (stderr, "could not send data\n");
+      exit (1);
+    }
+
+  batch->num = 0;
+}
+
+
+void
+init_session_table (struct session_table *table)
+{
+  int i;
+
+  for (i = 0; i < SESSION_TABLE_SIZE; i++)
+    table->slots [i].id = -1;
+}
+
+
+static unsigned int
+hash_address (uint32_t ip, uint16_t port)
+{
+  uint32_t h = ip * 0x9e3779b1u ^ port * 0x85ebca6bu;
+
+  return (h ^ h >> 16) & (SESSION_TABLE_SIZE-1);
+}
+
+
+/* returns the id of the player at addr, or -1 */
+int
+find_session (const struct session_table *table,
+	      const struct sockaddr_in *addr)
+{
+  uint32_t ip = addr->sin_addr.s_addr;
+  uint16_t port = addr->sin_port;
+  unsigned int i = hash_address (ip, port);
+
+  while (table->slots [i].id != -1)
+    {
+      if (table->slots [i].ip == ip && table->slots [i].port == port)
+	return table->slots [i].id;
+
+      i = (i+1) & (SESSION_TABLE_SIZE-1);
+    }
+
+  return -1;
+}
+
+
+/* maps addr to id, replacing any player that was there before */
+void
+add_session (struct session_table *table, const struct sockaddr_in *addr,
+	     int id)
+{
+  uint32_t ip = addr->sin_addr.s_addr;
+  uint16_t port = addr->sin_port;
+  unsigned int i = hash_address (ip, port);
+
+  while (table->slots [i].id != -1
+	 && (table->slots [i].ip != ip || table->slots [i].port != port))
+    i = (i+1) & (SESSION_TABLE_SIZE-1);
+
+  table->slots [i].ip = ip;
+  table->slots [i].port = port;
+  table->slots [i].id = id;
+}
+
+
+/* removes addr, if it still belongs to id.  The entries after it in the
+   same run are shifted back, so that lookups never need tombstones */
+void
+remove_session (struct session_table *table, const struct sockaddr_in *addr,
+		int id)
+{
+  uint32_t ip = addr->sin_addr.s_addr;
+  uint16_t port = addr->sin_port;
+  unsigned int i = hash_address (ip, port), j, home;
+
+  while (table->slots [i].id != -1
+	 && (table->slots [i].ip != ip || table->slots [i].port != port))
+    i = (i+1) & (SESSION_TABLE_SIZE-1);
+
+  if (table->slots [i].id != id)
+    return;
+
+  j = i;
+
+  while (1)
+    {
+      table->slots [i].id = -1;
+
+      do
+	{
+	  j = (j+1) & (SESSION_TABLE_SIZE-1);
+
+	  if (table->slots [j].id == -1)
+	    return;
+
+	  home = hash_address (table->slots [j].ip, table->slots [j].port);
+	}
+      while (i <= j ? i < home && home <= j : i < home || home <= j);
+
+      table->slots [i] = table->slots [j];
+      i = j;
+    }
+}
+
+void
+init_command_queue (struct command_queue *queue, unsigned int size)
+{
+  queue->commands = calloc_and_check (size, sizeof (*queue->commands));
+  queue->size = size;
+  atomic_init (&queue->head, 0);
+  atomic_init (&queue->tail, 0);
+
+  if (pipe (queue->wakefd) < 0
+      || fcntl (queue->wakefd [0], F_SETFL, O_NONBLOCK) < 0
+      || fcntl (queue->wakefd [1], F_SETFL, O_NONBLOCK) < 0)
+    {
+      fprintf (stderr, "could not create wakeup pipe\n");
+      exit (1);
+    }
+}
+
+
+/* called by the producer only.  Returns 0 if the queue is full */
+int
+push_command (struct command_queue *queue, const struct command *cmd)
+{
+  unsigned int head = atomic_load_explicit (&queue->head,
+					    memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit (&queue->tail,
+					    memory_order_acquire);
+
+  if (head-tail == queue->size)
+    return 0;
+
+  queue->commands [head % queue->size] = *cmd;
+  atomic_store_explicit (&queue->head, head+1, memory_order_release);
+  return 1;
+}
+
+
+/* called by the consumer only.  Returns 0 if the queue is empty */
+int
+pop_command (struct command_queue *queue, struct command *cmd)
+{
+  unsigned int tail = atomic_load_explicit (&queue->tail,
+					    memory_order_relaxed);
+  unsigned int head = atomic_load_explicit (&queue->head,
+					    memory_order_acquire);
+
+  if (head == tail)
+    return 0;
+
+  *cmd = queue->commands [tail % queue->size];
+  atomic_store_explicit (&queue->tail, tail+1, memory_order_release);
+  return 1;
+}
+
+
+static int
+make_command (const struct datagram *dgram, struct command *cmd)
+{
+  static struct message msg;
+
+  if (decode_message (dgram->data, dgram->len, NULL, &msg) < 0)
+    {
+      fprintf (stderr, "got a malformed message from client\n");
+      return 0;
+    }
+
+  cmd->addr = dgram->addr;
+  cmd->type = msg.type;
+
+  switch (msg.type)
+    {
+    case MSG_LOGIN:
+      cmd->args.login = msg.args.login;
+      break;
+    case MSG_CLIENT_CHAR_STATE:
+      cmd->args.client_char_state = msg.args.client_char_state;
+      break;
+    default:
+      fprintf (stderr, "message type not expected from client (%d)\n",
+	       msg.type);
+      return 0;
+    }
+
+  return 1;
+}
+
+
+static void *
+run_ingest_thread (void *arg)
+{
+  struct ingest_thread *ingest = arg;
+  struct command cmd;
+  int n, i, pushed;
+
+  while (1)
+    {
+      n = receive_datagrams (ingest->sockfd, &ingest->inbox);
+      pushed = 0;
+
+      for (i = 0; i < n; i++)
+	{
+	  if (!make_command (&ingest->inbox.datagrams [i], &cmd))
+	    continue;
+
+	  /* like the network itself, drop input rather than wait when the
+	     simulation falls behind */
+	  if (push_command (ingest->queue, &cmd))
+	    pushed = 1;
+	}
+
+      if (pushed && write (ingest->queue->wakefd [1], "", 1) < 0
+	  && errno != EAGAIN)
+	{
+	  fprintf (stderr, "could not wake up the simulation\n");
+	  exit (1);
+	}
+    }
+
+  return NULL;
+}
+
+
+void
+start_ingest_thread (struct ingest_thread *ingest, int sockfd,
+		     struct command_queue *queue)
+{
+  ingest->sockfd = sockfd;
+  ingest->queue = queue;
+  init_datagram_batch (&ingest->inbox, RECEIVE_BATCH_SIZE);
+
+  if (pthread_create (&ingest->thread, NULL, run_ingest_thread, ingest))
+    {
+      fprintf (stderr, "could not start the network thread\n");
+      exit (1);
+    }
+}
@@ -0,0 +1,163 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#define RECEIVE_BATCH_SIZE 64
+#define COMMAND_QUEUE_SIZE 1024
+#define OUTBOX_SIZE 256
+
+/* a power of two, at least twice MAX_PLAYERS so that probes stay short */
+#define SESSION_TABLE_SIZE 256
+
+
+
+struct
+datagram
+{
+  struct sockaddr_in addr;
+  size_t len;
+  unsigned char data [MAX_DATAGRAM_SIZE];
+};
+
+
+/* a preallocated set of datagrams that are received or sent with a single
+   system call where the platform allows it */
+struct
+datagram_batch
+{
+  struct datagram *datagrams;
+  int size;
+  int num;
+
+#if defined (HAVE_RECVMMSG) || defined (HAVE_SENDMMSG)
+  struct mmsghdr *headers;
+  struct iovec *iovecs;
+#endif
+};
+
+
+
+/* a client message decoded by the ingest thread, together with the
+   address it came from */
+struct
+command
+{
+  struct sockaddr_in addr;
+  int type;
+
+  union
+  {
+    struct login_args login;
+    struct client_char_state_args client_char_state;
+  } args;
+};
+
+
+/* a lock-free ring with exactly one producer, the ingest thread, and one
+   consumer, the tick thread.  head and tail only ever grow, and each of
+   them is written by one side alone.  The producer also writes a byte to
+   wakefd [1] after pushing, so that the consumer can sleep on wakefd [0] */
+struct
+command_queue
+{
+  struct command *commands;
+  unsigned int size;
+  _Atomic unsigned int head;
+  _Atomic unsigned int tail;
+  int wakefd [2];
+};
+
+
+struct
+ingest_thread
+{
+  pthread_t thread;
+  int sockfd;
+  struct datagram_batch inbox;
+  struct command_queue *queue;
+};
+
+
+/* maps the source address and port of each client to its player id, with
+   open addressing and linear probing */
+struct
+session
+{
+  uint32_t ip;
+  uint16_t port;
+  int id;
+};
+
+
+struct
+session_table
+{
+  struct session slots [SESSION_TABLE_SIZE];
+};
+
+
+/* waits until a file descriptor becomes readable or an absolute deadline on
+   the monotonic clock passes, whichever comes first */
+struct
+event_loop
+{
+  int fd;
+
+#if defined (HAVE_EPOLL_CREATE1) && defined (HAVE_TIMERFD_CREATE)
+  int epollfd;
+  int timerfd;
+  struct timespec armed;
+#endif
+};
+
+
+
+void get_monotonic_time (struct timespec *t);
+void add_nanoseconds (struct timespec *t, long ns);
+long long nanoseconds_between (const struct timespec *from,
+			       const struct timespec *to);
+
+void init_event_loop (struct event_loop *loop, int fd);
+int wait_for_input (struct event_loop *loop, const struct timespec *deadline);
+
+void init_datagram_batch (struct datagram_batch *batch, int size);
+
+int receive_datagrams (int sockfd, struct datagram_batch *batch);
+
+struct datagram *queue_datagram (int sockfd, struct datagram_batch *batch);
+void queue_encoded_message (int sockfd, struct datagram_batch *batch,
+			    const struct sockaddr_in *addr,
+			    const unsigned char *msg, size_t len,
+			    uint32_t frame);
+void flush_datagrams (int sockfd, struct datagram_batch *batch);
+
+void init_session_table (struct session_table *table);
+int find_session (const struct session_table *table,
+		  const struct sockaddr_in *addr);
+void add_session (struct session_table *table, const struct sockaddr_in *addr,
+		  int id);
+void remove_session (struct session_table *table,
+		     const struct sockaddr_in *addr, int id);
+
+void init_command_queue (struct command_queue *queue, unsigned int size);
+int push_command (struct command_queue *queue, const struct command *cmd);
+int pop_command (struct command_queue *queue, struct command *cmd);
+
+void start_ingest_thread (struct ingest_thread *ingest, int sockfd,
+			  struct command_queue *queue);
@@ -0,0 +1,951 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <SDL2/SDL_ttf.h>
+
+#include "zombieland.h"
+#include "packet.h"
+
+
+
+#define ACTION_INTERACT 1
+#define ACTION_SHOOT    2
+#define ACTION_STAB     4
+#define ACTION_SEARCH   8
+
+#define STATE_IMMORTAL     1
+#define STATE_JUST_SHOT    2
+#define STATE_JUST_STABBED 4
+
+#define FIELD_TYPE        0x001
+#define FIELD_SUBTYPE     0x002
+#define FIELD_DURATION    0x004
+#define FIELD_X           0x008
+#define FIELD_Y           0x010
+#define FIELD_W           0x020
+#define FIELD_H           0x040
+#define FIELD_FACING      0x080
+#define FIELD_SPEED_X     0x100
+#define FIELD_SPEED_Y     0x200
+#define FIELD_IS_IMMORTAL 0x400
+#define ALL_FIELDS        0x7ff
+#define FIELDS_BITS       11
+
+#define TYPE_BITS        4
+#define SUBTYPE_BITS     3
+#define DURATION_BITS    5
+#define COORD_BITS       16
+#define COORD_DELTA_BITS 7
+#define SPEED_BITS       8
+#define FACING_BITS      2
+
+
+
+void
+init_packet (struct packet *p, unsigned char *data, size_t size)
+{
+  p->data = data;
+  p->size = size;
+  p->pos = 0;
+  p->bit = 0;
+  p->error = 0;
+}
+
+
+void
+align_packet (struct packet *p)
+{
+  if (p->bit)
+    {
+      p->pos++;
+      p->bit = 0;
+    }
+}
+
+
+static int
+reserve (struct packet *p, size_t len)
+{
+  align_packet (p);
+
+  if (p->error || p->size-p->pos < len)
+    {
+      p->error = 1;
+      return 0;
+    }
+
+  return 1;
+}
+
+
+void
+write_u8 (struct packet *p, uint8_t val)
+{
+  if (reserve (p, 1))
+    p->data [p->pos++] = val;
+}
+
+
+void
+write_u16 (struct packet *p, uint16_t val)
+{
+  if (reserve (p, 2))
+    {
+      p->data [p->pos++] = val >> 8;
+      p->data [p->pos++] = val;
+    }
+}
+
+
+void
+write_u32 (struct packet *p, uint32_t val)
+{
+  if (reserve (p, 4))
+    {
+      p->data [p->pos++] = val >> 24;
+      p->data [p->pos++] = val >> 16;
+      p->data [p->pos++] = val >> 8;
+      p->data [p->pos++] = val;
+    }
+}
+
+
+void
+write_bytes (struct packet *p, const void *bytes, size_t len)
+{
+  if (reserve (p, len))
+    {
+      memcpy (p->data+p->pos, bytes, len);
+      p->pos += len;
+    }
+}
+
+
+uint8_t
+read_u8 (struct packet *p)
+{
+  if (!reserve (p, 1))
+    return 0;
+
+  return p->data [p->pos++];
+}
+
+
+uint16_t
+read_u16 (struct packet *p)
+{
+  uint16_t ret;
+
+  if (!reserve (p, 2))
+    return 0;
+
+  ret = (uint16_t)p->data [p->pos] << 8 | p->data [p->pos+1];
+  p->pos += 2;
+
+  return ret;
+}
+
+
+uint32_t
+read_u32 (struct packet *p)
+{
+  uint32_t ret;
+
+  if (!reserve (p, 4))
+    return 0;
+
+  ret = (uint32_t)p->data [p->pos] << 24 | (uint32_t)p->data [p->pos+1] << 16
+    | (uint32_t)p->data [p->pos+2] << 8 | p->data [p->pos+3];
+  p->pos += 4;
+
+  return ret;
+}
+
+
+void
+read_bytes (struct packet *p, void *bytes, size_t len)
+{
+  if (reserve (p, len))
+    {
+      memcpy (bytes, p->data+p->pos, len);
+      p->pos += len;
+    }
+}
+
+
+/* writes the n lowest bits of val, most significant first.  It is an
+   error if val doesn't fit */
+void
+write_bits (struct packet *p, uint32_t val, int n)
+{
+  int take;
+
+  if (n < 32 && val >> n)
+    p->error = 1;
+
+  while (n && !p->error)
+    {
+      if (!p->bit)
+	{
+	  if (p->pos == p->size)
+	    {
+	      p->error = 1;
+	      return;
+	    }
+
+	  p->data [p->pos] = 0;
+	}
+
+      take = n < 8-p->bit ? n : 8-p->bit;
+      n -= take;
+      p->data [p->pos] |= (val >> n & ((1u << take) - 1)) << (8-p->bit-take);
+      p->bit += take;
+
+      if (p->bit == 8)
+	{
+	  p->pos++;
+	  p->bit = 0;
+	}
+    }
+}
+
+
+static int
+fits_signed_bits (int32_t val, int n)
+{
+  return val >= -(1 << (n-1)) && val < 1 << (n-1);
+}
+
+
+void
+write_signed_bits (struct packet *p, int32_t val, int n)
+{
+  if (!fits_signed_bits (val, n))
+    p->error = 1;
+  else
+    write_bits (p, (uint32_t) val & ((1u << n) - 1), n);
+}
+
+
+uint32_t
+read_bits (struct packet *p, int n)
+{
+  uint32_t ret = 0;
+  int take;
+
+  while (n && !p->error)
+    {
+      if (p->pos == p->size)
+	{
+	  p->error = 1;
+	  return 0;
+	}
+
+      take = n < 8-p->bit ? n : 8-p->bit;
+      n -= take;
+      ret = ret << take
+	| (p->data [p->pos] >> (8-p->bit-take) & ((1u << take) - 1));
+      p->bit += take;
+
+      if (p->bit == 8)
+	{
+	  p->pos++;
+	  p->bit = 0;
+	}
+    }
+
+  return ret;
+}
+
+
+int32_t
+read_signed_bits (struct packet *p, int n)
+{
+  uint32_t val = read_bits (p, n);
+
+  return val & 1u << (n-1) ? (int32_t) (val | ~((1u << n) - 1)) : (int32_t) val;
+}
+
+
+/* small numbers in few bits: a 2-bit class selects a width of 4, 8, 16 or
+   32 bits */
+static void
+write_varbits (struct packet *p, uint32_t val)
+{
+  int class = val < 1u << 4 ? 0 : val < 1u << 8 ? 1 : val < 1u << 16 ? 2 : 3;
+
+  write_bits (p, class, 2);
+  write_bits (p, val, 4 << class);
+}
+
+
+static uint32_t
+read_varbits (struct packet *p)
+{
+  return read_bits (p, 4 << read_bits (p, 2));
+}
+
+
+static void
+encode_login (struct packet *p, const struct login_args *args)
+{
+  size_t len = strlen (args->logname);
+
+  write_u8 (p, len);
+  write_bytes (p, args->logname, len);
+  write_u8 (p, args->bodytype);
+}
+
+
+static void
+decode_login (struct packet *p, struct login_args *args)
+{
+  size_t len;
+
+  len = read_u8 (p);
+
+  if (len > MAX_LOGNAME_LEN)
+    {
+      p->error = 1;
+      return;
+    }
+
+  read_bytes (p, args->logname, len);
+  args->logname [len] = 0;
+  args->bodytype = read_u8 (p);
+}
+
+
+static void
+encode_loginok (struct packet *p, const struct loginok_args *args)
+{
+  write_u16 (p, args->id);
+  write_u32 (p, args->token);
+}
+
+
+static void
+decode_loginok (struct packet *p, struct loginok_args *args)
+{
+  args->id = read_u16 (p);
+  args->token = read_u32 (p);
+}
+
+
+static void
+encode_client_char_state (struct packet *p,
+			  const struct client_char_state_args *args)
+{
+  write_u16 (p, args->id);
+  write_u32 (p, args->token);
+  write_u32 (p, args->frame_counter);
+  write_u32 (p, args->ack_frame);
+  write_u16 (p, args->received);
+  write_u8 (p, (int8_t) args->char_speed_x);
+  write_u8 (p, (int8_t) args->char_speed_y);
+  write_u8 (p, args->char_facing);
+  write_u8 (p, (args->do_interact ? ACTION_INTERACT : 0)
+	    | (args->do_shoot ? ACTION_SHOOT : 0)
+	    | (args->do_stab ? ACTION_STAB : 0)
+	    | (args->do_search ? ACTION_SEARCH : 0));
+  write_u8 (p, (int8_t) args->swap [0]);
+  write_u8 (p, (int8_t) args->swap [1]);
+}
+
+
+static void
+decode_client_char_state (struct packet *p, struct client_char_state_args *args)
+{
+  uint8_t actions;
+
+  args->id = read_u16 (p);
+  args->token = read_u32 (p);
+  args->frame_counter = read_u32 (p);
+  args->ack_frame = read_u32 (p);
+  args->received = read_u16 (p);
+  args->char_speed_x = (int8_t) read_u8 (p);
+  args->char_speed_y = (int8_t) read_u8 (p);
+  args->char_facing = read_u8 (p) & 3;
+  actions = read_u8 (p);
+  args->do_interact = !!(actions & ACTION_INTERACT);
+  args->do_shoot = !!(actions & ACTION_SHOOT);
+  args->do_stab = !!(actions & ACTION_STAB);
+  args->do_search = !!(actions & ACTION_SEARCH);
+  args->swap [0] = (int8_t) read_u8 (p);
+  args->swap [1] = (int8_t) read_u8 (p);
+}
+
+
+static uint16_t
+compare_visibles (const struct visible *v1, const struct visible *v2)
+{
+  return (v1->type != v2->type ? FIELD_TYPE : 0)
+    | (v1->subtype != v2->subtype ? FIELD_SUBTYPE : 0)
+    | (v1->duration != v2->duration ? FIELD_DURATION : 0)
+    | (v1->x != v2->x ? FIELD_X : 0)
+    | (v1->y != v2->y ? FIELD_Y : 0)
+    | (v1->w != v2->w ? FIELD_W : 0)
+    | (v1->h != v2->h ? FIELD_H : 0)
+    | (v1->facing != v2->facing ? FIELD_FACING : 0)
+    | (v1->speed_x != v2->speed_x ? FIELD_SPEED_X : 0)
+    | (v1->speed_y != v2->speed_y ? FIELD_SPEED_Y : 0)
+    | (v1->is_immortal != v2->is_immortal ? FIELD_IS_IMMORTAL : 0);
+}
+
+
+/* a coordinate that changed since the baseline is usually sent as a small
+   difference from it.  Coordinates are signed on the wire, since shots
+   can land just outside an area */
+static void
+write_coord (struct packet *p, uint32_t val, const uint32_t *base)
+{
+  int32_t delta = base ? (int32_t) (val - *base) : 0;
+
+  if (base && delta >= -(1 << (COORD_DELTA_BITS-1))
+      && delta < 1 << (COORD_DELTA_BITS-1))
+    {
+      write_bits (p, 1, 1);
+      write_signed_bits (p, delta, COORD_DELTA_BITS);
+    }
+  else
+    {
+      write_bits (p, 0, 1);
+      write_signed_bits (p, (int32_t) val, COORD_BITS);
+    }
+}
+
+
+static uint32_t
+read_coord (struct packet *p, uint32_t base)
+{
+  if (read_bits (p, 1))
+    return base + read_signed_bits (p, COORD_DELTA_BITS);
+
+  return read_signed_bits (p, COORD_BITS);
+}
+
+
+/* each visible starts with the difference of its id from the previous one,
+   then either a set bit, for visibles not in the baseline, followed by all
+   the fields, or a clear bit followed by a mask of the fields that
+   changed */
+static void
+encode_visible (struct packet *p, const struct visible *vis,
+		const struct visible *base, uint32_t previd, uint16_t fields)
+{
+  write_varbits (p, vis->id - previd);
+  write_bits (p, !base, 1);
+
+  if (base)
+    write_bits (p, fields, FIELDS_BITS);
+
+  if (fields & FIELD_TYPE)
+    write_bits (p, vis->type, TYPE_BITS);
+  if (fields & FIELD_SUBTYPE)
+    write_bits (p, vis->subtype, SUBTYPE_BITS);
+  if (fields & FIELD_DURATION)
+    write_bits (p, vis->duration, DURATION_BITS);
+  if (fields & FIELD_X)
+    write_coord (p, vis->x, base ? &base->x : NULL);
+  if (fields & FIELD_Y)
+    write_coord (p, vis->y, base ? &base->y : NULL);
+  if (fields & FIELD_W)
+    write_varbits (p, vis->w);
+  if (fields & FIELD_H)
+    write_varbits (p, vis->h);
+  if (fields & FIELD_FACING)
+    write_bits (p, vis->facing, FACING_BITS);
+  if (fields & FIELD_SPEED_X)
+    write_signed_bits (p, vis->speed_x, SPEED_BITS);
+  if (fields & FIELD_SPEED_Y)
+    write_signed_bits (p, vis->speed_y, SPEED_BITS);
+  if (fields & FIELD_IS_IMMORTAL)
+    write_bits (p, vis->is_immortal, 1);
+}
+
+
+/* returns whether every field of vis fits in the bits it is sent in.  A
+   visible that does not would make the whole snapshot fail */
+int
+does_visible_fit (const struct visible *vis)
+{
+  return vis->type < 1u << TYPE_BITS && vis->subtype < 1u << SUBTYPE_BITS
+    && vis->duration < 1u << DURATION_BITS
+    && fits_signed_bits (vis->x, COORD_BITS)
+    && fits_signed_bits (vis->y, COORD_BITS)
+    && (uint32_t) vis->facing < 1u << FACING_BITS
+    && fits_signed_bits (vis->speed_x, SPEED_BITS)
+    && fits_signed_bits (vis->speed_y, SPEED_BITS) && vis->is_immortal < 2;
+}
+
+
+static void
+decode_visible_fields (struct packet *p, struct visible *vis, uint16_t fields)
+{
+  if (fields & FIELD_TYPE)
+    vis->type = read_bits (p, TYPE_BITS);
+  if (fields & FIELD_SUBTYPE)
+    vis->subtype = read_bits (p, SUBTYPE_BITS);
+  if (fields & FIELD_DURATION)
+    vis->duration = read_bits (p, DURATION_BITS);
+  if (fields & FIELD_X)
+    vis->x = read_coord (p, vis->x);
+  if (fields & FIELD_Y)
+    vis->y = read_coord (p, vis->y);
+  if (fields & FIELD_W)
+    vis->w = read_varbits (p);
+  if (fields & FIELD_H)
+    vis->h = read_varbits (p);
+  if (fields & FIELD_FACING)
+    vis->facing = read_bits (p, FACING_BITS);
+  if (fields & FIELD_SPEED_X)
+    vis->speed_x = read_signed_bits (p, SPEED_BITS);
+  if (fields & FIELD_SPEED_Y)
+    vis->speed_y = read_signed_bits (p, SPEED_BITS);
+  if (fields & FIELD_IS_IMMORTAL)
+    vis->is_immortal = read_bits (p, 1);
+}
+
+
+/* both lists are sorted by id.  We first send the ids that disappeared
+   since the baseline, then the visibles that are new or changed */
+static void
+encode_visibles (struct packet *p, const struct visible *vis, int num,
+		 const struct visible *base, int base_num)
+{
+  const struct visible *from [MAX_VISIBLES];
+  uint16_t fields [MAX_VISIBLES];
+  uint32_t previd;
+  int i, j, count;
+
+  for (i = 0, j = 0, count = 0; j < base_num; j++)
+    {
+      while (i < num && vis [i].id < base [j].id)
+	i++;
+
+      if (i == num || vis [i].id != base [j].id)
+	count++;
+    }
+
+  write_bits (p, count, 16);
+
+  for (i = 0, j = 0, previd = 0; j < base_num; j++)
+    {
+      while (i < num && vis [i].id < base [j].id)
+	i++;
+
+      if (i == num || vis [i].id != base [j].id)
+	{
+	  write_varbits (p, base [j].id - previd);
+	  previd = base [j].id;
+	}
+    }
+
+  for (i = 0, j = 0, count = 0; i < num; i++)
+    {
+      while (j < base_num && base [j].id < vis [i].id)
+	j++;
+
+      from [i] = j < base_num && base [j].id == vis [i].id ? &base [j] : NULL;
+      fields [i] = from [i] ? compare_visibles (&vis [i], from [i]) : ALL_FIELDS;
+
+      if (fields [i])
+	count++;
+    }
+
+  write_bits (p, count, 16);
+
+  for (i = 0, previd = 0; i < num; i++)
+    {
+      if (fields [i])
+	{
+	  encode_visible (p, &vis [i], from [i], previd, fields [i]);
+	  previd = vis [i].id;
+	}
+    }
+}
+
+
+static void
+decode_visibles (struct packet *p, struct visible *vis, uint32_t *num,
+		 const struct visible *base, int base_num)
+{
+  uint32_t removed [MAX_VISIBLES], id = 0, gap;
+  int removed_num, entries_num, i, j = 0, k = 0, n = 0, is_new;
+  uint16_t fields;
+
+  removed_num = read_bits (p, 16);
+
+  if (removed_num > base_num)
+    {
+      p->error = 1;
+      return;
+    }
+
+  for (i = 0; i < removed_num; i++)
+    {
+      gap = read_varbits (p);
+      removed [i] = (i ? removed [i-1] : 0) + gap;
+
+      if (i && (!gap || removed [i] < gap))
+	p->error = 1;
+    }
+
+  entries_num = read_bits (p, 16);
+
+  for (i = 0; i <= entries_num && !p->error; i++)
+    {
+      if (i < entries_num)
+	{
+	  gap = read_varbits (p);
+	  id += gap;
+
+	  if (i && (!gap || id < gap))
+	    p->error = 1;
+	}
+
+      while (j < base_num && (i == entries_num || base [j].id < id))
+	{
+	  while (k < removed_num && removed [k] < base [j].id)
+	    k++;
+
+	  if (k == removed_num || removed [k] != base [j].id)
+	    {
+	      if (n == MAX_VISIBLES)
+		{
+		  p->error = 1;
+		  return;
+		}
+
+	      vis [n++] = base [j];
+	    }
+
+	  j++;
+	}
+
+      if (i == entries_num)
+	break;
+
+      if (n == MAX_VISIBLES)
+	{
+	  p->error = 1;
+	  return;
+	}
+
+      is_new = read_bits (p, 1);
+
+      if (j < base_num && base [j].id == id && !is_new)
+	{
+	  vis [n] = base [j++];
+	  fields = read_bits (p, FIELDS_BITS);
+	}
+      else if (is_new && (j == base_num || base [j].id != id))
+	{
+	  memset (&vis [n], 0, sizeof (vis [n]));
+	  vis [n].id = id;
+	  fields = ALL_FIELDS;
+	}
+      else
+	{
+	  p->error = 1;
+	  return;
+	}
+
+      decode_visible_fields (p, &vis [n], fields);
+      n++;
+    }
+
+  *num = n;
+}
+
+
+static const struct snapshot *
+find_baseline (const struct snapshot *history, uint32_t frame)
+{
+  const struct snapshot *ret;
+
+  if (!frame || !history)
+    return NULL;
+
+  ret = &history [frame % SNAPSHOT_HISTORY];
+
+  return ret->frame == frame ? ret : NULL;
+}
+
+
+static void
+encode_server_state (struct packet *p, const struct server_state_args *args,
+		     const struct snapshot *history)
+{
+  const struct snapshot *base = find_baseline (history, args->baseline);
+  int i;
+
+  if (args->baseline && !base)
+    {
+      p->error = 1;
+      return;
+    }
+
+  write_u32 (p, args->frame_counter);
+  write_u32 (p, base ? args->baseline : 0);
+  write_u16 (p, args->areaid);
+  write_u16 (p, args->x);
+  write_u16 (p, args->y);
+  write_u16 (p, args->w);
+  write_u16 (p, args->h);
+  write_u8 (p, args->char_facing);
+  write_u16 (p, (int16_t) args->life);
+  write_u8 (p, (args->is_immortal ? STATE_IMMORTAL : 0)
+	    | (args->just_shot ? STATE_JUST_SHOT : 0)
+	    | (args->just_stabbed ? STATE_JUST_STABBED : 0));
+  write_u8 (p, args->bullets);
+  write_u8 (p, args->hunger);
+  write_u8 (p, args->thirst);
+  write_u8 (p, args->is_searching);
+
+  for (i = 0; i < BAG_SIZE*args->is_searching; i++)
+    write_u8 (p, args->bag [i]);
+
+  write_u16 (p, (int16_t) args->npcid);
+  write_u8 (p, args->textbox_lines_num);
+  write_bytes (p, args->textbox, TEXTLINESIZE*args->textbox_lines_num);
+  encode_visibles (p, args->visibles, args->num_visibles,
+		   base ? base->visibles : NULL, base ? base->num_visibles : 0);
+}
+
+
+static int
+decode_server_state (struct packet *p, struct server_state_args *args,
+		     const struct snapshot *history)
+{
+  const struct snapshot *base;
+  uint8_t flags;
+  int i;
+
+  args->frame_counter = read_u32 (p);
+  args->baseline = read_u32 (p);
+  base = find_baseline (history, args->baseline);
+
+  if (args->baseline && !base)
+    return DECODE_NO_BASELINE;
+
+  args->areaid = read_u16 (p);
+  args->x = read_u16 (p);
+  args->y = read_u16 (p);
+  args->w = read_u16 (p);
+  args->h = read_u16 (p);
+  args->char_facing = read_u8 (p) & 3;
+  args->life = (int16_t) read_u16 (p);
+  flags = read_u8 (p);
+  args->is_immortal = !!(flags & STATE_IMMORTAL);
+  args->just_shot = !!(flags & STATE_JUST_SHOT);
+  args->just_stabbed = !!(flags & STATE_JUST_STABBED);
+  args->bullets = read_u8 (p);
+  args->hunger = read_u8 (p);
+  args->thirst = read_u8 (p);
+  args->is_searching = read_u8 (p);
+
+  if (args->is_searching > 2)
+    return DECODE_MALFORMED;
+
+  for (i = 0; i < BAG_SIZE*2; i++)
+    args->bag [i] = i < BAG_SIZE*args->is_searching ? read_u8 (p) : OBJECT_NONE;
+
+  args->npcid = (int16_t) read_u16 (p);
+  args->textbox_lines_num = read_u8 (p);
+
+  if (args->textbox_lines_num > MAXTEXTLINES)
+    return DECODE_MALFORMED;
+
+  read_bytes (p, args->textbox, TEXTLINESIZE*args->textbox_lines_num);
+  args->textbox [TEXTLINESIZE*args->textbox_lines_num] = 0;
+  decode_visibles (p, args->visibles, &args->num_visibles,
+		   base ? base->visibles : NULL, base ? base->num_visibles : 0);
+
+  return 0;
+}
+
+
+size_t
+encode_message (const struct message *msg, const struct snapshot *history,
+		unsigned char *buf, size_t size)
+{
+  struct packet p;
+
+  init_packet (&p, buf, size);
+  write_u8 (&p, msg->type);
+
+  switch (msg->type)
+    {
+    case MSG_LOGIN:
+      encode_login (&p, &msg->args.login);
+      break;
+    case MSG_LOGINOK:
+      encode_loginok (&p, &msg->args.loginok);
+      break;
+    case MSG_CLIENT_CHAR_STATE:
+      encode_client_char_state (&p, &msg->args.client_char_state);
+      break;
+    case MSG_SERVER_STATE:
+      encode_server_state (&p, &msg->args.server_state, history);
+      break;
+    default:
+      break;
+    }
+
+  align_packet (&p);
+  return p.error ? 0 : p.pos;
+}
+
+
+int
+decode_message (const unsigned char *buf, size_t len,
+		const struct snapshot *history, struct message *msg)
+{
+  struct packet p;
+  int ret = 0;
+
+  init_packet (&p, (unsigned char *) buf, len);
+  msg->type = read_u8 (&p);
+
+  switch (msg->type)
+    {
+    case MSG_LOGIN:
+      decode_login (&p, &msg->args.login);
+      break;
+    case MSG_LOGINOK:
+      decode_loginok (&p, &msg->args.loginok);
+      break;
+    case MSG_LOGNAME_IN_USE:
+    case MSG_SERVER_FULL:
+    case MSG_PLAYER_DIED:
+      break;
+    case MSG_CLIENT_CHAR_STATE:
+      decode_client_char_state (&p, &msg->args.client_char_state);
+      break;
+    case MSG_SERVER_STATE:
+      ret = decode_server_state (&p, &msg->args.server_state, history);
+      break;
+    default:
+      return DECODE_MALFORMED;
+    }
+
+  if (ret)
+    return ret;
+
+  align_packet (&p);
+  return p.error || p.pos != len ? DECODE_MALFORMED : 0;
+}
+
+
+int
+count_fragments (size_t len)
+{
+  return (len+FRAGMENT_PAYLOAD_SIZE-1) / FRAGMENT_PAYLOAD_SIZE;
+}
+
+
+/* writes into buf the index-th fragment of the encoded message msg, which
+   is part of frame, and returns its length */
+size_t
+encode_fragment (const unsigned char *msg, size_t len, uint32_t frame,
+		 int index, unsigned char *buf)
+{
+  struct packet p;
+  size_t offset = (size_t) index * FRAGMENT_PAYLOAD_SIZE;
+  size_t size = len-offset < FRAGMENT_PAYLOAD_SIZE
+    ? len-offset : FRAGMENT_PAYLOAD_SIZE;
+
+  init_packet (&p, buf, MAX_DATAGRAM_SIZE);
+  write_u8 (&p, MSG_FRAGMENT);
+  write_u32 (&p, frame);
+  write_u8 (&p, index);
+  write_u8 (&p, count_fragments (len));
+  write_bytes (&p, msg+offset, size);
+
+  return p.pos;
+}
+
+
+void
+init_reassembly (struct reassembly *r)
+{
+  r->frame = 0;
+  r->count = 0;
+  r->received = 0;
+  r->len = 0;
+}
+
+
+/* returns 1 when buf completes a message, which is then in r->data, 0 if
+   more fragments are needed or buf belongs to an older frame, or
+   DECODE_MALFORMED */
+int
+add_fragment (struct reassembly *r, const unsigned char *buf, size_t len)
+{
+  struct packet p;
+  uint32_t frame;
+  size_t size;
+  int index, count;
+
+  init_packet (&p, (unsigned char *) buf, len);
+
+  if (read_u8 (&p) != MSG_FRAGMENT)
+    return DECODE_MALFORMED;
+
+  frame = read_u32 (&p);
+  index = read_u8 (&p);
+  count = read_u8 (&p);
+  size = len-FRAGMENT_HEADER_SIZE;
+
+  if (p.error || count < 2 || count > MAX_FRAGMENTS || index >= count
+      || (index < count-1 && size != FRAGMENT_PAYLOAD_SIZE)
+      || size < 1 || size > FRAGMENT_PAYLOAD_SIZE)
+    return DECODE_MALFORMED;
+
+  if (r->count && (int32_t) (frame - r->frame) < 0)
+    return 0;
+
+  if (!r->count || frame != r->frame)
+    {
+      r->frame = frame;
+      r->count = count;
+      r->received = 0;
+      r->len = 0;
+    }
+  else if (count != r->count)
+    return DECODE_MALFORMED;
+
+  if (r->received == (1u << count) - 1 || r->received & 1u << index)
+    return 0;
+
+  memcpy (r->data + (size_t) index * FRAGMENT_PAYLOAD_SIZE,
+	  buf+FRAGMENT_HEADER_SIZE, size);
+  r->received |= 1u << index;
+
+  if (index == count-1)
+    r->len = (size_t) index * FRAGMENT_PAYLOAD_SIZE + size;
+
+  return r->received == (1u << count) - 1;
+}
@@ -0,0 +1,99 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+/* the encoded form of a message is never longer than its in-memory form,
+   plus the ids removed by a delta */
+#define MAX_PACKET_SIZE (sizeof (struct message) + 6*MAX_VISIBLES)
+
+
+/* larger messages are split into fragments of at most this size, so that
+   they never need IP fragmentation on a common 1500-byte MTU */
+#define MAX_DATAGRAM_SIZE 1200
+#define FRAGMENT_HEADER_SIZE 7
+#define FRAGMENT_PAYLOAD_SIZE (MAX_DATAGRAM_SIZE-FRAGMENT_HEADER_SIZE)
+#define MAX_FRAGMENTS ((MAX_PACKET_SIZE+FRAGMENT_PAYLOAD_SIZE-1)	\
+		       / FRAGMENT_PAYLOAD_SIZE)
+
+
+#define DECODE_MALFORMED -1
+#define DECODE_NO_BASELINE -2
+
+
+
+/* a cursor over a wire buffer.  Writers use size as the capacity of data,
+   readers as the number of bytes received; in both cases error is set as
+   soon as an access would go past size, and later accesses do nothing.
+   The bit functions work inside data [pos], starting from its most
+   significant bit; bit counts how many of its bits are already used.  The
+   byte functions first skip to the next whole byte */
+struct
+packet
+{
+  unsigned char *data;
+  size_t size;
+  size_t pos;
+  int bit;
+  int error;
+};
+
+
+
+/* the fragments received so far of the newest fragmented message */
+struct
+reassembly
+{
+  uint32_t frame;
+  int count;
+  uint32_t received;
+  size_t len;
+  unsigned char data [MAX_PACKET_SIZE];
+};
+
+
+
+void init_packet (struct packet *p, unsigned char *data, size_t size);
+void align_packet (struct packet *p);
+
+void write_u8 (struct packet *p, uint8_t val);
+void write_u16 (struct packet *p, uint16_t val);
+void write_u32 (struct packet *p, uint32_t val);
+void write_bytes (struct packet *p, const void *bytes, size_t len);
+void write_bits (struct packet *p, uint32_t val, int n);
+void write_signed_bits (struct packet *p, int32_t val, int n);
+
+uint8_t read_u8 (struct packet *p);
+uint16_t read_u16 (struct packet *p);
+uint32_t read_u32 (struct packet *p);
+void read_bytes (struct packet *p, void *bytes, size_t len);
+uint32_t read_bits (struct packet *p, int n);
+int32_t read_signed_bits (struct packet *p, int n);
+
+size_t encode_message (const struct message *msg,
+		       const struct snapshot *history, unsigned char *buf,
+		       size_t size);
+int decode_message (const unsigned char *buf, size_t len,
+		    const struct snapshot *history, struct message *msg);
+int does_visible_fit (const struct visible *vis);
+
+int count_fragments (size_t len);
+size_t encode_fragment (const unsigned char *msg, size_t len, uint32_t frame,
+			int index, unsigned char *buf);
+void init_reassembly (struct reassembly *r);
+int add_fragment (struct reassembly *r, const unsigned char *buf, size_t len);
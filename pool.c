@@ -0,0 +1,141 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "malloc.h"
+#include "pool.h"
+
+
+
+int
+default_num_workers (void)
+{
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+  return n < 1 ? 1 : n > MAX_WORKERS ? MAX_WORKERS : n;
+}
+
+
+static void
+do_jobs (struct worker_pool *pool, int worker)
+{
+  int job;
+
+  while ((job = atomic_fetch_add (&pool->next_job, 1)) < pool->num_jobs)
+    pool->function (job, worker, pool->arg);
+}
+
+
+static void *
+run_worker (void *arg)
+{
+  struct worker *w = arg;
+  struct worker_pool *pool = w->pool;
+  unsigned int seen = 0;
+
+  while (1)
+    {
+      pthread_mutex_lock (&pool->lock);
+
+      while (pool->generation == seen)
+	pthread_cond_wait (&pool->start, &pool->lock);
+
+      seen = pool->generation;
+      pthread_mutex_unlock (&pool->lock);
+
+      do_jobs (pool, w->index);
+
+      pthread_mutex_lock (&pool->lock);
+
+      if (!--pool->running)
+	pthread_cond_signal (&pool->done);
+
+      pthread_mutex_unlock (&pool->lock);
+    }
+
+  return NULL;
+}
+
+
+void
+init_worker_pool (struct worker_pool *pool, int num_workers)
+{
+  int i;
+
+  pool->num_workers = num_workers;
+  pool->workers = calloc_and_check (num_workers, sizeof (*pool->workers));
+  pool->generation = 0;
+  pool->running = 0;
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->start, NULL);
+  pthread_cond_init (&pool->done, NULL);
+
+  for (i = 1; i < num_workers; i++)
+    {
+      pool->workers [i].pool = pool;
+      pool->workers [i].index = i;
+
+      if (pthread_create (&pool->workers [i].thread, NULL, run_worker,
+			  &pool->workers [i]))
+	{
+	  fprintf (stderr, "could not start worker thread\n");
+	  exit (1);
+	}
+    }
+}
+
+
+/* calls function on every job from 0 to num_jobs-1, spread over the pool,
+   and returns when all of them are done */
+void
+run_jobs (struct worker_pool *pool, int num_jobs,
+	  void (*function) (int job, int worker, void *arg), void *arg)
+{
+  pool->function = function;
+  pool->arg = arg;
+  pool->num_jobs = num_jobs;
+  atomic_store (&pool->next_job, 0);
+
+  if (pool->num_workers == 1 || num_jobs <= 1)
+    {
+      do_jobs (pool, 0);
+      return;
+    }
+
+  pthread_mutex_lock (&pool->lock);
+  pool->running = pool->num_workers-1;
+  pool->generation++;
+  pthread_cond_broadcast (&pool->start);
+  pthread_mutex_unlock (&pool->lock);
+
+  do_jobs (pool, 0);
+
+  pthread_mutex_lock (&pool->lock);
+
+  while (pool->running)
+    pthread_cond_wait (&pool->done, &pool->lock);
+
+  pthread_mutex_unlock (&pool->lock);
+}
@@ -0,0 +1,64 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#define MAX_WORKERS 32
+
+
+
+struct worker_pool;
+
+
+struct
+worker
+{
+  struct worker_pool *pool;
+  int index;
+  pthread_t thread;
+};
+
+
+/* a fixed set of threads that run numbered jobs in parallel.  The thread
+   calling run_jobs takes part as worker 0, so a pool of one worker
+   starts no threads at all */
+struct
+worker_pool
+{
+  int num_workers;
+  struct worker *workers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  unsigned int generation;
+  int running;
+
+  void (*function) (int job, int worker, void *arg);
+  void *arg;
+  int num_jobs;
+  _Atomic int next_job;
+};
+
+
+
+int default_num_workers (void);
+
+void init_worker_pool (struct worker_pool *pool, int num_workers);
+void run_jobs (struct worker_pool *pool, int num_jobs,
+	       void (*function) (int job, int worker, void *arg), void *arg);
@@ -0,0 +1,115 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "config.h"
+
+
+
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "prng.h"
+
+
+
+/* advances *x by a step of splitmix64 and returns its output */
+static uint64_t
+splitmix64 (uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+
+static uint64_t
+rotate_left (uint64_t x, int k)
+{
+  return (x << k) | (x >> (64-k));
+}
+
+
+void
+seed_prng (struct prng *p, uint64_t seed, uint64_t stream)
+{
+  uint64_t x = seed ^ splitmix64 (&stream);
+  int i;
+
+  for (i = 0; i < 4; i++)
+    p->s [i] = splitmix64 (&x);
+}
+
+
+/* fills the whole state of p from /dev/urandom, so that nobody can guess
+   the sequence from the time or the pid.  Returns 0 on failure */
+int
+seed_prng_from_system (struct prng *p)
+{
+  int fd = open ("/dev/urandom", O_RDONLY);
+  ssize_t n;
+
+  if (fd < 0)
+    return 0;
+
+  n = read (fd, p->s, sizeof (p->s));
+  close (fd);
+
+  return n == sizeof (p->s) && (p->s [0] | p->s [1] | p->s [2] | p->s [3]);
+}
+
+
+uint64_t
+get_random (struct prng *p)
+{
+  uint64_t ret = rotate_left (p->s [1]*5, 7) * 9, t = p->s [1] << 17;
+
+  p->s [2] ^= p->s [0];
+  p->s [3] ^= p->s [1];
+  p->s [1] ^= p->s [2];
+  p->s [0] ^= p->s [3];
+  p->s [2] ^= t;
+  p->s [3] = rotate_left (p->s [3], 45);
+
+  return ret;
+}
+
+
+/* returns a uniform number from 0 to n-1, for n positive.  The high
+   bits are scaled by n, and the few draws that would make some results
+   likelier are thrown away */
+int
+get_random_below (struct prng *p, int n)
+{
+  uint64_t m = (get_random (p) >> 32) * n;
+  uint32_t threshold;
+
+  if ((uint32_t) m < (uint32_t) n)
+    {
+      threshold = -(uint32_t) n % n;
+
+      while ((uint32_t) m < threshold)
+	m = (get_random (p) >> 32) * n;
+    }
+
+  return m >> 32;
+}
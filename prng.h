@@ -0,0 +1,34 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+/* a xoshiro256** generator.  Generators seeded with the same seed but
+   different streams give independent sequences */
+struct
+prng
+{
+  uint64_t s [4];
+};
+
+
+
+void seed_prng (struct prng *p, uint64_t seed, uint64_t stream);
+int seed_prng_from_system (struct prng *p);
+uint64_t get_random (struct prng *p);
+int get_random_below (struct prng *p, int n);
@@ -0,0 +1,203 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "config.h"
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#if defined (HAVE_IMMINTRIN_H) && defined (__GNUC__)	\
+  && (defined (__x86_64__) || defined (__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include <SDL2/SDL.h>
+
+#include "malloc.h"
+#include "rects.h"
+
+
+
+static int find_intersecting_rect_scalar (const struct rect_soa *soa,
+					  int begin, int end, SDL_Rect box);
+
+static int (*rect_kernel) (const struct rect_soa *soa, int begin, int end,
+			   SDL_Rect box) = find_intersecting_rect_scalar;
+
+
+
+void
+init_rect_soa (struct rect_soa *soa, int num)
+{
+  int i;
+
+  soa->num = num;
+  soa->x0 = malloc_and_check (sizeof (*soa->x0) * (num+RECT_SOA_PADDING));
+  soa->y0 = malloc_and_check (sizeof (*soa->y0) * (num+RECT_SOA_PADDING));
+  soa->x1 = malloc_and_check (sizeof (*soa->x1) * (num+RECT_SOA_PADDING));
+  soa->y1 = malloc_and_check (sizeof (*soa->y1) * (num+RECT_SOA_PADDING));
+
+  for (i = 0; i < num+RECT_SOA_PADDING; i++)
+    {
+      soa->x0 [i] = soa->y0 [i] = INT32_MAX;
+      soa->x1 [i] = soa->y1 [i] = INT32_MIN;
+    }
+}
+
+
+void
+set_rect_soa (struct rect_soa *soa, int i, SDL_Rect rect)
+{
+  soa->x0 [i] = rect.x;
+  soa->y0 [i] = rect.y;
+  soa->x1 [i] = rect.x+rect.w;
+  soa->y1 [i] = rect.y+rect.h;
+}
+
+
+/* the kernels return the first i in [begin, end) such that rect i
+   intersects box in the sense of RECT_INTERSECT, or -1 */
+static int
+find_intersecting_rect_scalar (const struct rect_soa *soa, int begin, int end,
+			       SDL_Rect box)
+{
+  int i;
+
+  for (i = begin; i < end; i++)
+    {
+      if (box.x+box.w > soa->x0 [i] && soa->x1 [i] > box.x
+	  && box.y+box.h > soa->y0 [i] && soa->y1 [i] > box.y)
+	return i;
+    }
+
+  return -1;
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__ ((target ("sse2")))
+static int
+find_intersecting_rect_sse2 (const struct rect_soa *soa, int begin, int end,
+			     SDL_Rect box)
+{
+  __m128i bx0 = _mm_set1_epi32 (box.x), bx1 = _mm_set1_epi32 (box.x+box.w),
+    by0 = _mm_set1_epi32 (box.y), by1 = _mm_set1_epi32 (box.y+box.h), hit;
+  int i, mask;
+
+  for (i = begin; i < end; i += 4)
+    {
+      hit = _mm_and_si128
+	(_mm_cmpgt_epi32 (bx1, _mm_loadu_si128 ((const __m128i *)
+						&soa->x0 [i])),
+	 _mm_cmpgt_epi32 (_mm_loadu_si128 ((const __m128i *) &soa->x1 [i]),
+			  bx0));
+      hit = _mm_and_si128
+	(hit, _mm_cmpgt_epi32 (by1, _mm_loadu_si128 ((const __m128i *)
+						     &soa->y0 [i])));
+      hit = _mm_and_si128
+	(hit, _mm_cmpgt_epi32 (_mm_loadu_si128 ((const __m128i *)
+						&soa->y1 [i]), by0));
+      mask = _mm_movemask_ps (_mm_castsi128_ps (hit));
+
+      if (end-i < 4)
+	mask &= (1 << (end-i)) - 1;
+
+      if (mask)
+	return i + __builtin_ctz (mask);
+    }
+
+  return -1;
+}
+
+
+__attribute__ ((target ("avx2")))
+static int
+find_intersecting_rect_avx2 (const struct rect_soa *soa, int begin, int end,
+			     SDL_Rect box)
+{
+  __m256i bx0 = _mm256_set1_epi32 (box.x),
+    bx1 = _mm256_set1_epi32 (box.x+box.w), by0 = _mm256_set1_epi32 (box.y),
+    by1 = _mm256_set1_epi32 (box.y+box.h), hit;
+  int i, mask;
+
+  for (i = begin; i < end; i += 8)
+    {
+      hit = _mm256_and_si256
+	(_mm256_cmpgt_epi32 (bx1, _mm256_loadu_si256 ((const __m256i *)
+						      &soa->x0 [i])),
+	 _mm256_cmpgt_epi32 (_mm256_loadu_si256 ((const __m256i *)
+						 &soa->x1 [i]), bx0));
+      hit = _mm256_and_si256
+	(hit, _mm256_cmpgt_epi32 (by1, _mm256_loadu_si256 ((const __m256i *)
+							   &soa->y0 [i])));
+      hit = _mm256_and_si256
+	(hit, _mm256_cmpgt_epi32 (_mm256_loadu_si256 ((const __m256i *)
+						      &soa->y1 [i]), by0));
+      mask = _mm256_movemask_ps (_mm256_castsi256_ps (hit));
+
+      if (end-i < 8)
+	mask &= (1 << (end-i)) - 1;
+
+      if (mask)
+	return i + __builtin_ctz (mask);
+    }
+
+  return -1;
+}
+
+#endif
+
+
+/* picks the widest kernel that the cpu supports and returns its name.
+   Until it is called, the scalar kernel is used */
+const char *
+select_rect_kernel (void)
+{
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init ();
+
+  if (__builtin_cpu_supports ("avx2"))
+    {
+      rect_kernel = find_intersecting_rect_avx2;
+      return "avx2";
+    }
+
+  if (__builtin_cpu_supports ("sse2"))
+    {
+      rect_kernel = find_intersecting_rect_sse2;
+      return "sse2";
+    }
+#endif
+
+  rect_kernel = find_intersecting_rect_scalar;
+  return "scalar";
+}
+
+
+int
+find_intersecting_rect (const struct rect_soa *soa, int begin, int end,
+			SDL_Rect box)
+{
+  return rect_kernel (soa, begin, end, box);
+}
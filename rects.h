@@ -0,0 +1,47 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+/* the widest kernel reads this many rects at a time, so arrays have as
+   many empty rects past their end */
+#define RECT_SOA_PADDING 8
+
+
+
+/* rects stored by coordinate, so that a kernel can test several of them
+   with one instruction.  Rect i spans from x0 [i] included to x1 [i]
+   excluded, and likewise on y */
+struct
+rect_soa
+{
+  int32_t *x0;
+  int32_t *y0;
+  int32_t *x1;
+  int32_t *y1;
+  int num;
+};
+
+
+
+void init_rect_soa (struct rect_soa *soa, int num);
+void set_rect_soa (struct rect_soa *soa, int i, SDL_Rect rect);
+
+const char *select_rect_kernel (void);
+int find_intersecting_rect (const struct rect_soa *soa, int begin, int end,
+			    SDL_Rect box);
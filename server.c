@@ -25,8 +25,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
 #include <strings.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -34,6 +36,9 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
@@ -41,6 +46,12 @@
 
 #include "malloc.h"
 #include "zombieland.h"
+#include "packet.h"
+#include "netio.h"
+#include "pool.h"
+#include "rects.h"
+#include "timers.h"
+#include "prng.h"
 #include "gui.h"
 
 
@@ -58,6 +69,15 @@
 
 #define ZOMBIE_SIGHT 110
 
+/* walkers chasing a player follow a field of walking distances on cells
+   of this side, which reaches up to FLOW_RANGE cells from the players */
+#define FLOW_CELL_SIZE GRID_CELL_W
+#define FLOW_RANGE 32
+#define FLOW_UNREACHED UINT16_MAX
+
+/* walkers look for players in cells of this side, at least ZOMBIE_SIGHT */
+#define PLAYER_CELL_SIZE 128
+
 #define MAX_ZOMBIE_HEALTH 12
 
 #define TOUCH_DAMAGE_FROM_WALKER 1
@@ -69,15 +89,73 @@
 #define IMMORTAL_DURATION 20
 
 
+/* obstacles are indexed in square cells of this side */
+#define OBSTACLE_CELL_SIZE 64
+#define MAX_QUERY_CELLS 9
+
+/* and baked into a bitmap of square tiles of this side, half a grid cell */
+#define OBSTACLE_TILE_SIZE (GRID_CELL_W/2)
+
+
+/* agents are hashed in square cells of this side by their top left
+   corner, and are never larger than MAX_AGENT_SIZE */
+#define AGENT_CELL_SIZE 64
+#define MAX_AGENT_SIZE (2*GRID_CELL_W)
+
+
+/* a move is swept at most this many times, once to the first contact and
+   once more to slide along it.  The agents it touches are reported up to
+   MAX_TOUCHED */
+#define MAX_SWEEPS 2
+#define MAX_TOUCHED 16
+
+#define SWEEP_X 1
+#define SWEEP_Y 2
+
+
+/* send rates are in bytes per tick */
+#define MIN_SEND_RATE 256
+#define MAX_SEND_RATE 16384
+#define INITIAL_SEND_RATE 4096
+#define SEND_RATE_STEP 128
+#define MAX_SEND_INTERVAL 6
+#define RATE_WINDOW 30
+#define MIN_RATE_SAMPLE 8
+
+#define MIN_VISIBLE_BUDGET 16
+#define VISIBLE_BUDGET_STEP 8
+
+
+/* where the priority of a waiting visible stops growing, so that adding
+   to it never overflows */
+#define MAX_PRIORITY 0x40000000
+
+
 #define MAX_HUNGER 20
 #define HUNGER_UP 1800
 #define MAX_THIRST 20
 #define THIRST_UP 1800
 
 
+/* what main does when a timer expires.  Passive timers only tell by
+   being pending that something is still going on */
+enum
+timer_kind
+  {
+    TIMER_PASSIVE,
+    TIMER_PLAYER_FREEZE,
+    TIMER_ZOMBIE_FREEZE,
+    TIMER_HUNGER,
+    TIMER_THIRST,
+    TIMER_TIMEOUT,
+    TIMER_SHOT
+  };
+
+
 struct
 object
 {
+  uint32_t id;
   struct server_area *area;
   SDL_Rect place;
   enum object_type type;
@@ -86,6 +164,16 @@ object
 };
 
 
+/* how long a visible has been waiting to be sent, see
+   select_visibles */
+struct
+priority
+{
+  uint32_t id;
+  uint32_t value;
+};
+
+
 struct
 player
 {
@@ -93,9 +181,26 @@ player
   struct agent *agent;
 
   struct sockaddr_in address;
-  uint16_t portoffset;
+  uint32_t token;
   uint32_t last_update;
 
+  struct snapshot *snapshots;
+  uint32_t acked_frame;
+
+  struct priority *priorities;
+  int priorities_num;
+  int priorities_capacity;
+
+  int32_t send_rate;
+  int32_t send_credit;
+  int visible_budget;
+  int ticks_since_snapshot;
+  size_t last_snapshot_len;
+  uint32_t snapshots_sent;
+  uint32_t sent_at [SNAPSHOT_HISTORY];
+  uint32_t sample_sent, window_sent;
+  uint16_t sample_received, window_received;
+
   char name [MAX_LOGNAME_LEN+1];
   uint32_t bodytype;
   int32_t speed_x, speed_y;
@@ -106,23 +211,24 @@ player
   uint32_t is_searching;
   struct bag *might_search_at;
   int32_t swap1, swap2;
-  int swap_rest;
+  struct timer swap_rest;
 
   struct object bag [BAG_SIZE];
 
-  uint32_t hunger, hunger_up, thirst, thirst_up;
+  uint32_t hunger, thirst;
+  struct timer hunger_up, thirst_up;
 
   int interact;
   int npcid;
   char *textbox;
   int textbox_lines_num;
 
-  int freeze;
+  struct timer freeze;
 
-  int shoot_rest;
-  int stab_rest;
+  struct timer shoot_rest;
+  struct timer stab_rest;
 
-  int timeout;
+  struct timer timeout;
 };
 
 
@@ -139,10 +245,14 @@ struct zombie
   enum facing facing;
 
   int32_t speed_x, speed_y;
-  int freeze;
+  struct timer freeze;
 
-  int next_thinking;
+  struct timer next_thinking;
+  int target;
+  uint32_t target_agent;
+  int is_following;
 
+  struct server_area *home;
   struct zombie *next;
 };
 
@@ -166,6 +276,7 @@ agent_data_ptr
 struct
 agent
 {
+  uint32_t id;
   struct server_area *area;
   struct private_server_area *private_area;
   SDL_Rect place;
@@ -173,22 +284,26 @@ agent
   struct private_server_area *priv_areas;
 
   int32_t life;
-  int immortal;
+  struct timer immortal;
 
   enum agent_type type;
   union agent_data_ptr data_ptr;
 
-  struct agent *prev;
-  struct agent *next;
+  int set_index;
+
+  int cell;
+  struct agent *cell_prev;
+  struct agent *cell_next;
 };
 
 
 struct
 shot
 {
+  uint32_t id;
   uint32_t areaid;
   SDL_Rect target;
-  int duration;
+  struct timer duration;
   struct shot *next;
 };
 
@@ -203,12 +318,18 @@ interactible
 };
 
 
+/* distance has the steps from each flow cell of the area of the warp to
+   the warp itself.  route_costs [a] is the number of steps a zombie takes
+   through this warp to reach the area of id a, or INT_MAX; see
+   init_warp_routes */
 struct
 warp
 {
   SDL_Rect place;
   struct server_area *dest;
   SDL_Rect spawn;
+  uint16_t *distance;
+  int *route_costs;
   struct warp *next;
 };
 
@@ -234,6 +355,162 @@ bag
 };
 
 
+/* the obstacles of an area bucketed by the cells they touch.  The
+   obstacles of cell c are rects [items [start [c]]] to rects [items [start
+   [c+1]-1]], in the same order as in rects.  all holds the rects by
+   coordinate and cell_rects the same for each of items, so that the
+   obstacles of a cell can be tested in batches.  A bit of tiles is set
+   when some obstacle covers part of its tile; each row of tiles takes
+   tile_words words */
+struct
+obstacle_index
+{
+  SDL_Rect *rects;
+  int rects_num;
+  int cols, rows;
+  int *start;
+  int *items;
+
+  struct rect_soa all;
+  struct rect_soa cell_rects;
+
+  uint32_t *tiles;
+  int tile_cols, tile_rows, tile_words;
+};
+
+
+/* the state of a walk over the obstacles that may intersect a box, see
+   next_obstacle */
+struct
+obstacle_iter
+{
+  const struct obstacle_index *obs;
+  int cells_num;
+  int cursors [MAX_QUERY_CELLS];
+  int ends [MAX_QUERY_CELLS];
+  int next;
+};
+
+
+/* the first contacts of a box moving by speed_x and speed_y, see
+   sweep_rect.  hull covers the whole move.  time is den if nothing was
+   hit; axes has the axes stopped by the rects hit at time, except those
+   hit exactly on a corner, which only set corner.  deeper has the axes
+   along which the box would go deeper into an obstacle that it already
+   overlaps */
+struct
+sweep
+{
+  SDL_Rect box;
+  SDL_Rect hull;
+  int speed_x, speed_y;
+  int den;
+  int time;
+  int axes;
+  int corner;
+  int deeper;
+};
+
+
+/* agents, each in the list of the cell of its top left corner.  They
+   must be moved with move_agent and warp_agent to stay in the right
+   cell */
+struct
+agent_grid
+{
+  int cols, rows;
+  struct agent **cells;
+};
+
+
+/* the state of a walk over the agents whose corners are in some cells,
+   see next_agent */
+struct
+agent_iter
+{
+  const struct agent_grid *grid;
+  int col0, col1, row1;
+  int col, row;
+  struct agent *next;
+};
+
+
+/* the agents of an area, or of an instance of a private area, in no
+   particular order and in a grid.  They are removed by moving the last one
+   in their place */
+struct
+agent_set
+{
+  struct agent **agents;
+  int num;
+  int capacity;
+  struct agent_grid grid;
+};
+
+
+/* entities of one kind bucketed by cell.  The items of cell c are
+   items [start [c]] to items [start [c+1]-1] */
+struct
+cell_index
+{
+  int *start;
+  int *fill;
+  void **items;
+  int capacity;
+};
+
+
+/* the area of interest of an area: its agents, objects and shots bucketed
+   into cells as large as a window, so that whatever a player can see is in
+   the 3x3 cells around it.  It is rebuilt every tick before snapshots,
+   together with the visibles of each cell, which are then shared by all
+   the players nearby.  The visibles of cell c are visibles [visibles_start
+   [c]] to visibles [visibles_start [c+1]-1] */
+struct
+aoi_grid
+{
+  int cols, rows;
+  struct cell_index agents;
+  struct cell_index objects;
+  struct cell_index shots;
+
+  struct visible *visibles;
+  int *visibles_start;
+  int visibles_capacity;
+};
+
+
+/* the number of steps from each cell of an area to the cell of the
+   nearest player, walking across the sides of cells that no obstacle
+   touches.  It is rebuilt only when some player changes cell: seeds has
+   the cells of the players it was built from, in order of player index,
+   and queue [0] to queue [reached_num-1] the cells it reached */
+struct
+flow_field
+{
+  int cols, rows;
+  uint8_t *blocked;
+  uint16_t *distance;
+  int *queue;
+  int reached_num;
+  int *seeds;
+  int seeds_num;
+};
+
+
+/* the players of an area bucketed by the cell of their top left corner,
+   in order of id.  The players of cell c are items [start [c]] to items
+   [start [c+1]-1].  Cells are stored row by row, so the 3 cells around a
+   cell in each row are a single run of items */
+struct
+player_index
+{
+  int cols, rows;
+  int *start;
+  struct agent **items;
+};
+
+
 struct
 server_area
 {
@@ -243,11 +520,17 @@ server_area
   int full_obstacles_num;
   SDL_Rect *half_obstacles;
   int half_obstacles_num;
+  struct obstacle_index full_index;
+  struct obstacle_index half_index;
 
   struct warp *warps;
   struct interactible *interactibles;
   struct interactible *npcs;
 
+  struct agent_set agents;
+
+  /* zombies_num counts the zombies spawned here, also those that went
+     elsewhere after a player */
   struct zombie *zombies;
   int zombies_num;
   SDL_Rect *zombie_spawns;
@@ -261,6 +544,12 @@ server_area
 
   struct bag *bags;
 
+  struct aoi_grid aoi;
+  struct flow_field flow;
+  struct player_index players;
+
+  struct prng prng;
+
   struct server_area *next;
 };
 
@@ -276,6 +565,8 @@ private_server_area
 
   struct object *objects;
 
+  struct agent_set agents;
+
   struct bag *bags;
 
   struct private_server_area *next;
@@ -283,6 +574,18 @@ private_server_area
 
 
 
+uint32_t
+new_entity_id (void)
+{
+  static uint32_t next_id = 1;
+
+  if (next_id == VISIBLE_ID_ICON)
+    next_id = 1;
+
+  return next_id++;
+}
+
+
 void
 set_rect (SDL_Rect *rect, int x, int y, int w, int h)
 {
@@ -293,6 +596,205 @@ set_rect (SDL_Rect *rect, int x, int y, int w, int h)
 }
 
 
+void
+init_agent_set (struct agent_set *set, SDL_Rect walkable)
+{
+  set->agents = NULL;
+  set->num = set->capacity = 0;
+  set->grid.cols = walkable.w / AGENT_CELL_SIZE + 1;
+  set->grid.rows = walkable.h / AGENT_CELL_SIZE + 1;
+  set->grid.cells = calloc_and_check (set->grid.cols*set->grid.rows,
+				      sizeof (*set->grid.cells));
+}
+
+
+struct agent_set *
+get_agent_set (struct agent *a)
+{
+  return a->area->is_private ? &a->private_area->agents : &a->area->agents;
+}
+
+
+int
+get_agent_cell (const struct agent_grid *grid, int x, int y)
+{
+  int col = x < 0 ? 0 : x / AGENT_CELL_SIZE,
+    row = y < 0 ? 0 : y / AGENT_CELL_SIZE;
+
+  if (col >= grid->cols)
+    col = grid->cols-1;
+
+  if (row >= grid->rows)
+    row = grid->rows-1;
+
+  return row*grid->cols+col;
+}
+
+
+void
+hash_agent (struct agent *a)
+{
+  struct agent_grid *grid = &get_agent_set (a)->grid;
+  struct agent **head = &grid->cells [a->cell = get_agent_cell (grid,
+								a->place.x,
+								a->place.y)];
+
+  a->cell_prev = NULL;
+  a->cell_next = *head;
+
+  if (*head)
+    (*head)->cell_prev = a;
+
+  *head = a;
+}
+
+
+void
+unhash_agent (struct agent *a)
+{
+  if (a->cell_prev)
+    a->cell_prev->cell_next = a->cell_next;
+  else
+    get_agent_set (a)->grid.cells [a->cell] = a->cell_next;
+
+  if (a->cell_next)
+    a->cell_next->cell_prev = a->cell_prev;
+}
+
+
+void
+move_agent (struct agent *a, SDL_Rect place)
+{
+  a->place = place;
+
+  if (get_agent_cell (&get_agent_set (a)->grid, place.x, place.y) != a->cell)
+    {
+      unhash_agent (a);
+      hash_agent (a);
+    }
+}
+
+
+/* puts a in the set and in the grid of its area */
+void
+add_agent (struct agent *a)
+{
+  struct agent_set *set = get_agent_set (a);
+  struct agent **agents;
+
+  if (set->num == set->capacity)
+    {
+      set->capacity = set->capacity ? set->capacity*2 : 16;
+      agents = malloc_and_check (sizeof (*agents) * set->capacity);
+
+      if (set->num)
+	memcpy (agents, set->agents, sizeof (*agents) * set->num);
+
+      free (set->agents);
+      set->agents = agents;
+    }
+
+  a->set_index = set->num;
+  set->agents [set->num++] = a;
+  hash_agent (a);
+}
+
+
+void
+remove_agent (struct agent *a)
+{
+  struct agent_set *set = get_agent_set (a);
+
+  set->agents [a->set_index] = set->agents [--set->num];
+  set->agents [a->set_index]->set_index = a->set_index;
+  unhash_agent (a);
+}
+
+
+/* par is the instance of dest that a enters, if dest is private */
+void
+warp_agent (struct agent *a, struct server_area *dest,
+	    struct private_server_area *par, int x, int y)
+{
+  remove_agent (a);
+  a->area = dest;
+
+  if (dest->is_private)
+    a->private_area = par;
+
+  a->place.x = x;
+  a->place.y = y;
+  add_agent (a);
+}
+
+
+/* walks the agents whose top left corner may be from x0, y0 to x1, y1.
+   Agents must not move until the walk is over */
+void
+init_agent_iter (struct agent_iter *it, const struct agent_grid *grid, int x0,
+		 int y0, int x1, int y1)
+{
+  int first = get_agent_cell (grid, x0, y0), last = get_agent_cell (grid, x1,
+								     y1);
+
+  it->grid = grid;
+  it->col0 = first % grid->cols;
+  it->col1 = last % grid->cols;
+  it->row1 = last / grid->cols;
+  it->col = it->col0-1;
+  it->row = first / grid->cols;
+  it->next = NULL;
+}
+
+
+/* walks the agents that may intersect box */
+void
+find_agents_in_box (struct agent_iter *it, const struct agent_grid *grid,
+		    SDL_Rect box)
+{
+  init_agent_iter (it, grid, box.x-MAX_AGENT_SIZE, box.y-MAX_AGENT_SIZE,
+		   box.x+box.w, box.y+box.h);
+}
+
+
+/* walks the agents whose top left corner may be less than radius away
+   from that of place on both axes */
+void
+find_agents_near (struct agent_iter *it, const struct agent_grid *grid,
+		  SDL_Rect place, int radius)
+{
+  init_agent_iter (it, grid, place.x-radius, place.y-radius, place.x+radius,
+		   place.y+radius);
+}
+
+
+struct agent *
+next_agent (struct agent_iter *it)
+{
+  struct agent *ret;
+
+  while (!it->next)
+    {
+      if (it->row > it->row1)
+	return NULL;
+
+      if (++it->col > it->col1)
+	{
+	  it->col = it->col0;
+
+	  if (++it->row > it->row1)
+	    return NULL;
+	}
+
+      it->next = it->grid->cells [it->row*it->grid->cols+it->col];
+    }
+
+  ret = it->next;
+  it->next = ret->cell_next;
+  return ret;
+}
+
+
 struct private_server_area *
 allocate_private_areas (struct server_area *areas)
 {
@@ -326,6 +828,7 @@ allocate_private_areas (struct server_area *areas)
 	    par->object_spawns [i].place = areas->object_spawns [i].place;
 
 	  par->objects = NULL;
+	  init_agent_set (&par->agents, areas->walkable);
 
 	  par->bags = NULL;
 	  bs = areas->bags;
@@ -359,9 +862,9 @@ allocate_private_areas (struct server_area *areas)
 
 uint32_t
 create_player (char name[], uint32_t bodytype, struct sockaddr_in *addr,
-	       uint16_t portoff, struct server_area *area,
+	       struct server_area *area,
 	       struct server_area *areas, struct player pls [],
-	       struct agent **agents)
+	       struct timer_wheel *timers, struct prng *tokens)
 {
   int i, j;
   struct agent *a;
@@ -377,6 +880,7 @@ create_player (char name[], uint32_t bodytype, struct sockaddr_in *addr,
     return -1;
 
   a = malloc_and_check (sizeof (*a));
+  a->id = new_entity_id ();
   a->area = area;
   a->private_area = NULL;
   set_rect (&a->place, 16, 16, 16, 16);
@@ -400,50 +904,72 @@ create_player (char name[], uint32_t bodytype, struct sockaddr_in *addr,
     }
 
   a->life = MAX_PLAYER_HEALTH;
-  a->immortal = 0;
+  init_timer (&a->immortal, TIMER_PASSIVE, NULL);
   a->type = AGENT_PLAYER;
   a->data_ptr.player = &pls [i];
-  a->prev = NULL;
-  a->next = *agents;
-
-  if (*agents)
-    (*agents)->prev = a;
-
-  *agents = a;
+  add_agent (a);
 
   pls [i].id = i;
   pls [i].agent = a;
   memcpy (&pls [i].address, addr, sizeof (*addr));
-  pls [i].address.sin_port = htons (ZOMBIELAND_PORT+portoff);
-  pls [i].portoffset = portoff;
+  pls [i].token = get_random (tokens);
   pls [i].last_update = 0;
+  pls [i].snapshots = calloc_and_check (SNAPSHOT_HISTORY,
+					sizeof (*pls [i].snapshots));
+  pls [i].acked_frame = 0;
+  pls [i].priorities = NULL;
+  pls [i].priorities_num = pls [i].priorities_capacity = 0;
+  pls [i].send_rate = INITIAL_SEND_RATE;
+  pls [i].send_credit = 0;
+  pls [i].visible_budget = MAX_VISIBLES;
+  pls [i].ticks_since_snapshot = 0;
+  pls [i].last_snapshot_len = 0;
+  pls [i].snapshots_sent = pls [i].sample_sent = pls [i].window_sent = 0;
+  pls [i].sample_received = pls [i].window_received = 0;
   strcpy (pls [i].name, name);
   pls [i].bodytype = bodytype;
   pls [i].speed_x = pls [i].speed_y = pls [i].facing = 0;
   pls [i].bullets = 16;
   pls [i].is_searching = 0;
   pls [i].might_search_at = NULL;
-  pls [i].swap_rest = 0;
+  init_timer (&pls [i].swap_rest, TIMER_PASSIVE, NULL);
 
   for (j = 0; j < BAG_SIZE; j++)
     pls [i].bag [j].type = OBJECT_NONE;
 
   pls [i].hunger = 0;
-  pls [i].hunger_up = HUNGER_UP;
+  init_timer (&pls [i].hunger_up, TIMER_HUNGER, &pls [i]);
+  start_timer (timers, &pls [i].hunger_up, HUNGER_UP);
   pls [i].thirst = 0;
-  pls [i].thirst_up = THIRST_UP;
+  init_timer (&pls [i].thirst_up, TIMER_THIRST, &pls [i]);
+  start_timer (timers, &pls [i].thirst_up, THIRST_UP);
   pls [i].interact = 0;
   pls [i].textbox = NULL;
   pls [i].textbox_lines_num = 0;
-  pls [i].freeze = 0;
-  pls [i].shoot_rest = 0;
-  pls [i].stab_rest = 0;
-  pls [i].timeout = CLIENT_TIMEOUT;
+  init_timer (&pls [i].freeze, TIMER_PLAYER_FREEZE, &pls [i]);
+  init_timer (&pls [i].shoot_rest, TIMER_PASSIVE, NULL);
+  init_timer (&pls [i].stab_rest, TIMER_PASSIVE, NULL);
+  init_timer (&pls [i].timeout, TIMER_TIMEOUT, &pls [i]);
+  start_timer (timers, &pls [i].timeout, CLIENT_TIMEOUT);
 
   return i;
 }
 
 
+void
+stop_player_timers (struct player *pl)
+{
+  stop_timer (&pl->agent->immortal);
+  stop_timer (&pl->swap_rest);
+  stop_timer (&pl->hunger_up);
+  stop_timer (&pl->thirst_up);
+  stop_timer (&pl->freeze);
+  stop_timer (&pl->shoot_rest);
+  stop_timer (&pl->stab_rest);
+  stop_timer (&pl->timeout);
+}
+
+
 struct interactible *
 make_interactible_by_grid (int placex, int placey, int placew, int placeh,
 			   char *text, struct interactible *next)
@@ -476,6 +1002,8 @@ make_warp_by_grid (int placex, int placey, int placew, int placeh,
   ret->dest = dest;
   ret->spawn.x = spawnx * GRID_CELL_W;
   ret->spawn.y = spawny * GRID_CELL_H;
+  ret->distance = NULL;
+  ret->route_costs = NULL;
   ret->next = next;
 
   return ret;
@@ -484,892 +1012,2398 @@ make_warp_by_grid (int placex, int placey, int placew, int placeh,
 
 struct zombie *
 make_zombie (enum zombie_type type, int placex, int placey, enum facing facing,
-	     struct server_area *area, struct zombie *next, struct agent **agents)
+	     struct server_area *area, struct zombie *next)
 {
   struct zombie *ret = malloc_and_check (sizeof (*ret));
   struct agent *a = malloc_and_check (sizeof (*a));
 
+  a->id = new_entity_id ();
   a->area = area;
   set_rect (&a->place, placex, placey,
 	    type == ZOMBIE_WALKER ? GRID_CELL_W : 2*GRID_CELL_W,
 	    type == ZOMBIE_WALKER ? GRID_CELL_H : 2*GRID_CELL_H);
   a->life = MAX_ZOMBIE_HEALTH;
-  a->immortal = 0;
+  init_timer (&a->immortal, TIMER_PASSIVE, NULL);
   a->type = AGENT_ZOMBIE;
   a->data_ptr.zombie = ret;
-  a->prev = NULL;
-  a->next = *agents;
-
-  if (*agents)
-    (*agents)->prev = a;
-
-  *agents = a;
+  add_agent (a);
 
   ret->type = type;
   ret->agent = a;
   ret->facing = facing;
   ret->speed_x = ret->speed_y = 0;
-  ret->freeze = 0;
-  ret->next_thinking = 0;
+  init_timer (&ret->freeze, TIMER_ZOMBIE_FREEZE, ret);
+  init_timer (&ret->next_thinking, TIMER_PASSIVE, NULL);
+  ret->target = -1;
+  ret->target_agent = 0;
+  ret->is_following = 0;
+  ret->home = area;
   ret->next = next;
 
   return ret;
 }
 
 
-int
-is_rect_free (SDL_Rect charbox, int speed_x, int speed_y, SDL_Rect unwalkables [],
-	      int unwalkables_num)
+/* the cells touched by rect, counting its right and bottom edges, so that
+   intersecting rects always share a cell.  Rects outside the area go to
+   the nearest border cells */
+void
+get_obstacle_cells (const struct obstacle_index *obs, SDL_Rect rect,
+		    int *col0, int *row0, int *col1, int *row1)
 {
-  int i;
+  *col0 = rect.x < 0 ? 0 : rect.x / OBSTACLE_CELL_SIZE;
+  *row0 = rect.y < 0 ? 0 : rect.y / OBSTACLE_CELL_SIZE;
+  *col1 = rect.x+rect.w < 0 ? 0 : (rect.x+rect.w) / OBSTACLE_CELL_SIZE;
+  *row1 = rect.y+rect.h < 0 ? 0 : (rect.y+rect.h) / OBSTACLE_CELL_SIZE;
 
-  charbox.x += speed_x;
-  charbox.y += speed_y;
+  if (*col0 >= obs->cols)
+    *col0 = obs->cols-1;
 
-  for (i = 0; i < unwalkables_num; i++)
-    {
-      if (RECT_INTERSECT (charbox, unwalkables [i]))
-	return 0;
-    }
+  if (*col1 >= obs->cols)
+    *col1 = obs->cols-1;
 
-  return 1;
+  if (*row0 >= obs->rows)
+    *row0 = obs->rows-1;
+
+  if (*row1 >= obs->rows)
+    *row1 = obs->rows-1;
 }
 
 
-SDL_Rect
-check_and_resolve_collision (SDL_Rect charbox, int *speed_x, int *speed_y,
-			     SDL_Rect unwalkable, SDL_Rect unwalkables [],
-			     int unwalkables_num, int *did_collide)
+/* the tiles of the pixels covered by a span of len pixels from pos.  An
+   obstacle of no width still blocks boxes that cross it, so it covers the
+   pixels on both sides */
+void
+get_tile_span (int pos, int len, int tiles, int *first, int *last)
+{
+  int end = len ? pos+len-1 : pos;
+
+  if (!len)
+    pos--;
+
+  *first = pos < 0 ? 0 : pos / OBSTACLE_TILE_SIZE;
+  *last = end < 0 ? 0 : end / OBSTACLE_TILE_SIZE;
+
+  if (*first >= tiles)
+    *first = tiles-1;
+
+  if (*last >= tiles)
+    *last = tiles-1;
+}
+
+
+void
+bake_obstacle_tiles (struct obstacle_index *obs, SDL_Rect walkable)
 {
-  int new, can_move_x, can_move_y;
+  int col0, row0, col1, row1, c, r, i;
 
-  *did_collide = 0;
+  obs->tile_cols = walkable.w / OBSTACLE_TILE_SIZE + 1;
+  obs->tile_rows = walkable.h / OBSTACLE_TILE_SIZE + 1;
+  obs->tile_words = (obs->tile_cols+31) / 32;
+  obs->tiles = calloc_and_check (obs->tile_rows*obs->tile_words,
+				 sizeof (*obs->tiles));
 
-  if (RECT_INTERSECT (charbox, unwalkable))
+  for (i = 0; i < obs->rects_num; i++)
     {
-      *did_collide = 1;
-      charbox.x -= *speed_x;
-      charbox.y -= *speed_y;
+      get_tile_span (obs->rects [i].x, obs->rects [i].w, obs->tile_cols, &col0,
+		     &col1);
+      get_tile_span (obs->rects [i].y, obs->rects [i].h, obs->tile_rows, &row0,
+		     &row1);
+
+      for (r = row0; r <= row1; r++)
+	for (c = col0; c <= col1; c++)
+	  obs->tiles [r*obs->tile_words+c/32] |= (uint32_t) 1 << c%32;
+    }
+}
 
-      if (RECT_X_INTERSECT (charbox, unwalkable))
-	{
-	  charbox.x += *speed_x;
 
-	  if (*speed_y > 0)
-	    {
-	      new = unwalkable.y-charbox.h;
-	    }
-	  else
-	    {
-	      new = unwalkable.y+unwalkable.h;
-	    }
+/* returns 1 if box surely intersects no obstacle of obs, with a few bit
+   tests.  When it returns 0 the box may still be free, and only the
+   obstacles themselves can tell */
+int
+is_box_clear (const struct obstacle_index *obs, SDL_Rect box)
+{
+  int col0, row0, col1, row1, r, word;
+  uint32_t mask;
 
-	  *speed_y = new-charbox.y;
-	  charbox.y = new;
-	}
-      else if (RECT_Y_INTERSECT (charbox, unwalkable))
-	{
-	  charbox.y += *speed_y;
+  if (!obs)
+    return 1;
 
-	  if (*speed_x > 0)
-	    {
-	      new = unwalkable.x-charbox.w;
-	    }
-	  else
-	    {
-	      new = unwalkable.x+unwalkable.w;
-	    }
+  if (box.w <= 0 || box.h <= 0)
+    return 0;
 
-	  *speed_x = new-charbox.x;
-	  charbox.x = new;
-	}
-      else
+  get_tile_span (box.x, box.w, obs->tile_cols, &col0, &col1);
+  get_tile_span (box.y, box.h, obs->tile_rows, &row0, &row1);
+
+  for (r = row0; r <= row1; r++)
+    {
+      for (word = col0/32; word <= col1/32; word++)
 	{
-	  can_move_x = is_rect_free (charbox, *speed_x > 0 ? 1 : -1, 0,
-				     unwalkables, unwalkables_num);
-	  can_move_y = is_rect_free (charbox, 0, *speed_y > 0 ? 1 : -1,
-				     unwalkables, unwalkables_num);
+	  mask = ~(uint32_t) 0;
 
-	  if (can_move_x && !can_move_y)
-	    {
-	      charbox.x += *speed_x;
+	  if (word == col0/32)
+	    mask &= ~(uint32_t) 0 << col0%32;
 
-	      if (*speed_y > 0)
-		{
-		  new = unwalkable.y-charbox.h;
-		}
-	      else
-		{
-		  new = unwalkable.y+unwalkable.h;
-		}
+	  if (word == col1/32)
+	    mask &= ~(uint32_t) 0 >> (31-col1%32);
 
-	      *speed_y = new-charbox.y;
-	      charbox.y = new;
-	    }
-	  else if (!can_move_x && can_move_y)
-	    {
-	      charbox.y += *speed_y;
+	  if (obs->tiles [r*obs->tile_words+word] & mask)
+	    return 0;
+	}
+    }
 
-	      if (*speed_x > 0)
-		{
-		  new = unwalkable.x-charbox.w;
-		}
-	      else
-		{
-		  new = unwalkable.x+unwalkable.w;
-		}
+  return 1;
+}
 
-	      *speed_x = new-charbox.x;
-	      charbox.x = new;
-	    }
-	  else
-	    {
-	      if (*speed_y > 0)
-		{
-		  new = unwalkable.y-charbox.h;
-		}
-	      else
-		{
-		  new = unwalkable.y+unwalkable.h;
-		}
 
-	      *speed_y = new-charbox.y;
-	      charbox.y = new;
+void
+init_obstacle_index (struct obstacle_index *obs, SDL_Rect rects [],
+		     int rects_num, SDL_Rect walkable)
+{
+  int cells, col0, row0, col1, row1, c, r, i, *fill;
 
-	      if (*speed_x > 0)
-		{
-		  new = unwalkable.x-charbox.w;
-		}
-	      else
-		{
-		  new = unwalkable.x+unwalkable.w;
-		}
+  obs->rects = rects;
+  obs->rects_num = rects_num;
+  obs->cols = walkable.w / OBSTACLE_CELL_SIZE + 1;
+  obs->rows = walkable.h / OBSTACLE_CELL_SIZE + 1;
+  cells = obs->cols*obs->rows;
+  obs->start = calloc_and_check (cells+1, sizeof (*obs->start));
 
-	      *speed_x = new-charbox.x;
-	      charbox.x = new;
-	    }
-	}
+  for (i = 0; i < rects_num; i++)
+    {
+      get_obstacle_cells (obs, rects [i], &col0, &row0, &col1, &row1);
+
+      for (r = row0; r <= row1; r++)
+	for (c = col0; c <= col1; c++)
+	  obs->start [r*obs->cols+c+1]++;
     }
 
-  return charbox;
+  for (i = 0; i < cells; i++)
+    obs->start [i+1] += obs->start [i];
+
+  obs->items = malloc_and_check (sizeof (*obs->items) * (obs->start [cells]+1));
+  fill = malloc_and_check (sizeof (*fill) * cells);
+  memcpy (fill, obs->start, sizeof (*fill) * cells);
+
+  for (i = 0; i < rects_num; i++)
+    {
+      get_obstacle_cells (obs, rects [i], &col0, &row0, &col1, &row1);
+
+      for (r = row0; r <= row1; r++)
+	for (c = col0; c <= col1; c++)
+	  obs->items [fill [r*obs->cols+c]++] = i;
+    }
+
+  free (fill);
+
+  init_rect_soa (&obs->all, rects_num);
+  init_rect_soa (&obs->cell_rects, obs->start [cells]);
+
+  for (i = 0; i < rects_num; i++)
+    set_rect_soa (&obs->all, i, rects [i]);
+
+  for (i = 0; i < obs->start [cells]; i++)
+    set_rect_soa (&obs->cell_rects, i, rects [obs->items [i]]);
+
+  bake_obstacle_tiles (obs, walkable);
 }
 
 
-SDL_Rect
-check_and_resolve_collisions (SDL_Rect charbox, int *speed_x, int *speed_y,
-			      SDL_Rect unwalkables [], int unwalkables_num,
-			      int *did_collide)
+/* returns the index of the first obstacle of obs that intersects box, or
+   -1.  Cells list their obstacles in order, so the first hit of each cell
+   is the only one that can be the first overall */
+int
+find_first_obstacle (const struct obstacle_index *obs, SDL_Rect box)
 {
-  int i, collided;
+  int col0, row0, col1, row1, c, r, hit, ret = -1;
+
+  if (!obs)
+    return -1;
 
-  *did_collide = 0;
+  get_obstacle_cells (obs, box, &col0, &row0, &col1, &row1);
 
-  for (i = 0; i < unwalkables_num; i++)
-    {
-      charbox = check_and_resolve_collision (charbox, speed_x, speed_y,
-					     unwalkables [i], unwalkables,
-					     unwalkables_num, &collided);
+  if ((col1-col0+1)*(row1-row0+1) > MAX_QUERY_CELLS)
+    return find_intersecting_rect (&obs->all, 0, obs->rects_num, box);
 
-      if (collided)
+  for (r = row0; r <= row1; r++)
+    {
+      for (c = col0; c <= col1; c++)
 	{
-	  *did_collide = 1;
-	  return charbox;
+	  hit = find_intersecting_rect (&obs->cell_rects,
+					obs->start [r*obs->cols+c],
+					obs->start [r*obs->cols+c+1], box);
+
+	  if (hit >= 0 && (ret == -1 || obs->items [hit] < ret))
+	    ret = obs->items [hit];
 	}
     }
 
-  return charbox;
+  return ret;
 }
 
 
-SDL_Rect
-check_boundary (SDL_Rect charbox, int speed_x, int speed_y, SDL_Rect walkable)
+/* obs can be NULL, for no obstacles.  A box that touches too many cells
+   walks all of them */
+void
+init_obstacle_iter (struct obstacle_iter *it, const struct obstacle_index *obs,
+		    SDL_Rect box)
 {
-  if (charbox.x+charbox.w > walkable.w)
-    charbox.x = walkable.w-charbox.w;
+  int col0, row0, col1, row1, c, r;
 
-  if (charbox.x < 0)
-    charbox.x = 0;
+  it->obs = obs;
+  it->cells_num = 0;
+  it->next = -1;
 
-  if (charbox.y+charbox.h > walkable.h)
-    charbox.y = walkable.h-charbox.h;
+  if (!obs)
+    return;
 
-  if (charbox.y < 0)
-    charbox.y = 0;
+  get_obstacle_cells (obs, box, &col0, &row0, &col1, &row1);
 
-  return charbox;
+  if ((col1-col0+1)*(row1-row0+1) > MAX_QUERY_CELLS)
+    {
+      it->next = 0;
+      return;
+    }
+
+  for (r = row0; r <= row1; r++)
+    {
+      for (c = col0; c <= col1; c++)
+	{
+	  it->cursors [it->cells_num] = obs->start [r*obs->cols+c];
+	  it->ends [it->cells_num++] = obs->start [r*obs->cols+c+1];
+	}
+    }
 }
 
 
-SDL_Rect
-move_character (struct player *pl, SDL_Rect walkable, SDL_Rect full_obstacles [],
-		int full_obstacles_num, SDL_Rect half_obstacles [],
-		int half_obstacles_num, struct zombie *zs, int *character_hit)
+/* returns the next obstacle in index order, or NULL.  Cells list their
+   obstacles in order, so merging them gives each obstacle once */
+SDL_Rect *
+next_obstacle (struct obstacle_iter *it)
 {
-  int collided, speed_x = pl->speed_x, speed_y = pl->speed_y;
-  struct zombie *z;
-  SDL_Rect charbox = pl->agent->place;
+  int i, min = -1;
 
-  *character_hit = 0;
+  if (it->next >= 0)
+    return it->next < it->obs->rects_num ? &it->obs->rects [it->next++] : NULL;
+
+  for (i = 0; i < it->cells_num; i++)
+    {
+      if (it->cursors [i] < it->ends [i]
+	  && (min == -1 || it->obs->items [it->cursors [i]] < min))
+	min = it->obs->items [it->cursors [i]];
+    }
+
+  if (min == -1)
+    return NULL;
+
+  for (i = 0; i < it->cells_num; i++)
+    {
+      if (it->cursors [i] < it->ends [i]
+	  && it->obs->items [it->cursors [i]] == min)
+	it->cursors [i]++;
+    }
+
+  return &it->obs->rects [min];
+}
+
+
+int
+is_rect_free (SDL_Rect charbox, int speed_x, int speed_y,
+	      const struct obstacle_index *obs)
+{
   charbox.x += speed_x;
   charbox.y += speed_y;
 
- restart:
-  if (!speed_x && !speed_y)
-    return charbox;
+  return is_box_clear (obs, charbox) || find_first_obstacle (obs, charbox) < 0;
+}
 
-  charbox = check_and_resolve_collisions (charbox, &speed_x, &speed_y,
-					  full_obstacles, full_obstacles_num,
-					  &collided);
 
-  if (collided)
-    goto restart;
+/* the times at which a span of len pixels from pos, moving by speed,
+   starts and stops overlapping the span of rlen pixels from rpos, in
+   units of 1/den of the move.  Returns 0 if they never overlap */
+int
+sweep_span (int pos, int len, int speed, int rpos, int rlen, int den,
+	    int *entry, int *exit)
+{
+  if (!speed)
+    {
+      *entry = INT_MIN;
+      *exit = INT_MAX;
+      return pos+len > rpos && rpos+rlen > pos;
+    }
 
-  charbox = check_and_resolve_collisions (charbox, &speed_x, &speed_y,
-					  half_obstacles, half_obstacles_num,
-					  &collided);
+  if (speed > 0)
+    {
+      *entry = (rpos-pos-len) * (den/speed);
+      *exit = (rpos+rlen-pos) * (den/speed);
+    }
+  else
+    {
+      *entry = (pos-rpos-rlen) * (den/-speed);
+      *exit = (pos+len-rpos) * (den/-speed);
+    }
 
-  if (collided)
-    goto restart;
+  return 1;
+}
 
-  z = zs;
 
-  while (z)
-    {
-      charbox = check_and_resolve_collision (charbox, &speed_x, &speed_y,
-					     z->agent->place, NULL, 0,
-					     &collided);
+/* finds when box, moving by speed_x and speed_y, starts overlapping rect
+   in the sense of RECT_INTERSECT.  Returns 0 if it does not during the
+   move, -1 if it already overlaps rect at the start, else the axes along
+   which rect stops it, with both of them for a corner, and puts the time
+   in *time */
+int
+sweep_rect (SDL_Rect box, int speed_x, int speed_y, int den, SDL_Rect rect,
+	    int *time)
+{
+  int entry_x, exit_x, entry_y, exit_y, entry, exit;
 
-      if (collided)
-	{
-	  if (!pl->agent->immortal)
-	    {
-	      pl->agent->immortal = IMMORTAL_DURATION;
-	      pl->agent->life -= z->type == ZOMBIE_WALKER
-		? TOUCH_DAMAGE_FROM_WALKER : TOUCH_DAMAGE_FROM_BLOB;
-	      pl->freeze = 6;
-	      pl->speed_x = -pl->speed_x*2;
-	      pl->speed_y = -pl->speed_y*2;
-	    }
+  if (!sweep_span (box.x, box.w, speed_x, rect.x, rect.w, den, &entry_x,
+		   &exit_x)
+      || !sweep_span (box.y, box.h, speed_y, rect.y, rect.h, den, &entry_y,
+		      &exit_y))
+    return 0;
 
-	  *character_hit = 1;
-	  goto restart;
-	}
+  entry = entry_x > entry_y ? entry_x : entry_y;
+  exit = exit_x < exit_y ? exit_x : exit_y;
+
+  if (entry >= exit || entry >= den || exit <= 0)
+    return 0;
+
+  if (entry < 0)
+    return -1;
+
+  *time = entry;
+  return (entry_x == entry ? SWEEP_X : 0) | (entry_y == entry ? SWEEP_Y : 0);
+}
+
+
+void
+init_sweep (struct sweep *sw, SDL_Rect box, int speed_x, int speed_y)
+{
+  sw->box = box;
+  sw->speed_x = speed_x;
+  sw->speed_y = speed_y;
+  sw->den = (speed_x ? abs (speed_x) : 1) * (speed_y ? abs (speed_y) : 1);
+  sw->time = sw->den;
+  sw->axes = sw->corner = sw->deeper = 0;
+
+  sw->hull = box;
+  sw->hull.x += speed_x < 0 ? speed_x : 0;
+  sw->hull.y += speed_y < 0 ? speed_y : 0;
+  sw->hull.w += abs (speed_x);
+  sw->hull.h += abs (speed_y);
+}
+
+
+/* returns the result of sweep_rect for rect, after keeping its contact
+   if it is among the first ones */
+int
+add_contact (struct sweep *sw, SDL_Rect rect)
+{
+  int axes, time;
 
-      z = z->next;
+  axes = sweep_rect (sw->box, sw->speed_x, sw->speed_y, sw->den, rect, &time);
+
+  if (axes <= 0 || time > sw->time)
+    return axes;
+
+  if (time < sw->time)
+    {
+      sw->time = time;
+      sw->axes = sw->corner = 0;
     }
 
-  return check_boundary (charbox, speed_x, speed_y, walkable);
+  if (axes == (SWEEP_X | SWEEP_Y))
+    sw->corner = 1;
+  else
+    sw->axes |= axes;
+
+  return axes;
 }
 
 
-SDL_Rect
-move_zombie (SDL_Rect charbox, struct server_area *area, int speed_x, int speed_y,
-	     SDL_Rect walkable, SDL_Rect full_obstacles [],
-	     int full_obstacles_num, SDL_Rect half_obstacles [],
-	     int half_obstacles_num, struct player pls [], enum zombie_type zt)
+/* the axes along which the box of sw moves towards the center of rect,
+   which it overlaps already */
+int
+get_deeper_axes (const struct sweep *sw, SDL_Rect rect)
 {
-  int collided, i, sx = speed_x, sy = speed_y;
+  int dx = 2*rect.x+rect.w - 2*sw->box.x-sw->box.w,
+    dy = 2*rect.y+rect.h - 2*sw->box.y-sw->box.h;
 
-  charbox.x += speed_x;
-  charbox.y += speed_y;
+  return (sw->speed_x*dx > 0 ? SWEEP_X : 0)
+    | (sw->speed_y*dy > 0 ? SWEEP_Y : 0);
+}
 
- restart:
-  if (!speed_x && !speed_y)
-    return charbox;
 
-  charbox = check_and_resolve_collisions (charbox, &speed_x, &speed_y,
-					  full_obstacles, full_obstacles_num,
-					  &collided);
+void
+add_obstacle_contact (struct sweep *sw, SDL_Rect rect)
+{
+  if (add_contact (sw, rect) < 0)
+    sw->deeper |= get_deeper_axes (sw, rect);
+}
+
 
-  if (collided)
-    goto restart;
+/* adds the obstacles of obs that the hull of the sweep intersects */
+void
+sweep_obstacles (struct sweep *sw, const struct obstacle_index *obs)
+{
+  int col0, row0, col1, row1, c, r, i, end;
 
-  charbox = check_and_resolve_collisions (charbox, &speed_x, &speed_y,
-					  half_obstacles, half_obstacles_num,
-					  &collided);
+  if (is_box_clear (obs, sw->hull))
+    return;
 
-  if (collided)
-    goto restart;
+  get_obstacle_cells (obs, sw->hull, &col0, &row0, &col1, &row1);
 
-  for (i = 0; i < MAX_PLAYERS; i++)
+  if ((col1-col0+1)*(row1-row0+1) > MAX_QUERY_CELLS)
     {
-      if (pls [i].id == -1 || area != pls [i].agent->area)
-	continue;
+      for (i = 0; (i = find_intersecting_rect (&obs->all, i, obs->rects_num,
+					       sw->hull)) >= 0; i++)
+	add_obstacle_contact (sw, obs->rects [i]);
 
-      charbox = check_and_resolve_collision (charbox, &speed_x, &speed_y,
-					     pls [i].agent->place, NULL, 0,
-					     &collided);
+      return;
+    }
 
-      if (collided)
+  for (r = row0; r <= row1; r++)
+    {
+      for (c = col0; c <= col1; c++)
 	{
-	  if (!pls [i].agent->immortal)
-	    {
-	      pls [i].agent->immortal = IMMORTAL_DURATION;
-	      pls [i].agent->life -= zt == ZOMBIE_WALKER
-		? TOUCH_DAMAGE_FROM_WALKER : TOUCH_DAMAGE_FROM_BLOB;
-	      pls [i].freeze = 6;
-	      pls [i].speed_x = sx*4;
-	      pls [i].speed_y = sy*4;
-	    }
+	  i = obs->start [r*obs->cols+c];
+	  end = obs->start [r*obs->cols+c+1];
 
-	  goto restart;
+	  for (; (i = find_intersecting_rect (&obs->cell_rects, i, end,
+					      sw->hull)) >= 0; i++)
+	    add_obstacle_contact (sw, obs->rects [obs->items [i]]);
 	}
     }
+}
 
-  return check_boundary (charbox, speed_x, speed_y, walkable);
+
+/* the axes stopped by a contact that is only on corners.  Like before
+   sweeps, the box slides along the one axis that is free, if there is
+   just one */
+int
+get_corner_axes (SDL_Rect box, int speed_x, int speed_y,
+		 const struct obstacle_index *full_obstacles,
+		 const struct obstacle_index *half_obstacles)
+{
+  int free_x = is_rect_free (box, SIGN (speed_x), 0, full_obstacles)
+    && is_rect_free (box, SIGN (speed_x), 0, half_obstacles);
+  int free_y = is_rect_free (box, 0, SIGN (speed_y), full_obstacles)
+    && is_rect_free (box, 0, SIGN (speed_y), half_obstacles);
+
+  if (free_x && !free_y)
+    return SWEEP_Y;
+
+  if (!free_x && free_y)
+    return SWEEP_X;
+
+  return SWEEP_X | SWEEP_Y;
 }
 
 
-uint32_t
-compute_nearest_player (struct zombie *z, struct player pls [], int *distance)
+void
+add_touched (struct agent *touched [], int *touched_num, struct agent *a)
 {
-  uint32_t i, nearest = -1, dist;
+  int i;
 
-  for (i = 0; i < MAX_PLAYERS; i++)
+  for (i = 0; i < *touched_num; i++)
     {
-      if (pls [i].id != -1 && z->agent->area == pls [i].agent->area)
-	{
-	  dist = abs (z->agent->place.x-pls[i].agent->place.x)
-	    + abs (z->agent->place.y-pls[i].agent->place.y);
-
-	  if (nearest == -1 || dist < *distance)
-	    {
-	      nearest = i;
-	      *distance = dist;
-	    }
-	}
+      if (touched [i] == a)
+	return;
     }
 
-  return nearest;
+  if (*touched_num < MAX_TOUCHED)
+    touched [(*touched_num)++] = a;
 }
 
 
-int
-is_target_hit (SDL_Rect charbox, enum facing facing, SDL_Rect target,
-	       int is_agent, int *distance, SDL_Rect *hitpart)
+/* moves box by speed_x and speed_y until it hits an obstacle or an agent
+   of type blocking, then slides along what it hit for the rest of the
+   move.  A box that starts inside an obstacle can move out of it or
+   along it, but not deeper.  The blocking agents that it hits, or that
+   it overlaps when it starts, go in touched */
+SDL_Rect
+slide_box (SDL_Rect box, int speed_x, int speed_y,
+	   const struct obstacle_index *full_obstacles,
+	   const struct obstacle_index *half_obstacles,
+	   const struct agent_grid *agents, enum agent_type blocking,
+	   struct agent *touched [], int *touched_num)
 {
-  switch (facing)
+  struct sweep sw;
+  struct agent_iter it;
+  struct agent *as;
+  int sweeps, axes, time, moved_x, moved_y;
+
+  *touched_num = 0;
+
+  for (sweeps = 0; sweeps < MAX_SWEEPS && (speed_x || speed_y); sweeps++)
     {
-    case FACING_DOWN:
-      if (charbox.y<target.y
-	  && target.x<=charbox.x+charbox.w/2
-	  && charbox.x+charbox.w/2 <= target.x+target.w)
+      init_sweep (&sw, box, speed_x, speed_y);
+      sweep_obstacles (&sw, full_obstacles);
+      sweep_obstacles (&sw, half_obstacles);
+
+      if (sw.deeper)
 	{
-	  hitpart->x = charbox.x;
-	  hitpart->y = target.y;
-	  *distance = target.y-charbox.h-charbox.y;
-	  return 1;
+	  speed_x = sw.deeper & SWEEP_X ? 0 : speed_x;
+	  speed_y = sw.deeper & SWEEP_Y ? 0 : speed_y;
+	  sweeps--;
+	  continue;
 	}
-      break;
-    case FACING_UP:
-      if ((charbox.y>target.y || (!is_agent && charbox.y==target.y))
-	  && target.x<=charbox.x+charbox.w/2
-	  && charbox.x+charbox.w/2 <= target.x+target.w)
+
+      find_agents_in_box (&it, agents, sw.hull);
+
+      while ((as = next_agent (&it)))
 	{
-	  hitpart->x = charbox.x;
-	  hitpart->y = target.y+target.h-GRID_CELL_H;
-	  *distance = charbox.y-target.h-target.y;
-	  return 1;
+	  if (as->type == blocking && add_contact (&sw, as->place) < 0)
+	    add_touched (touched, touched_num, as);
 	}
-      break;
-    case FACING_RIGHT:
-      if (charbox.x<target.x
-	  && target.y<=charbox.y+charbox.h/2
-	  && charbox.y+charbox.h/2 <= target.y+target.h)
+
+      if (sw.time == sw.den)
 	{
-	  hitpart->x = target.x;
-	  hitpart->y = charbox.y;
-	  *distance = target.x-charbox.w-charbox.x;
-	  return 1;
+	  box.x += speed_x;
+	  box.y += speed_y;
+	  break;
 	}
-      break;
-    case FACING_LEFT:
-      if ((charbox.x>target.x || (!is_agent && charbox.x==target.x))
-	  && target.y<=charbox.y+charbox.h/2
-	  && charbox.y+charbox.h/2 <= target.y+target.h)
+
+      find_agents_in_box (&it, agents, sw.hull);
+
+      while ((as = next_agent (&it)))
 	{
-	  hitpart->x = target.x+target.w-GRID_CELL_W;
-	  hitpart->y = charbox.y;
-	  *distance = charbox.x-target.w-target.x;
-	  return 1;
+	  if (as->type == blocking
+	      && sweep_rect (box, speed_x, speed_y, sw.den, as->place,
+			     &time) > 0
+	      && time == sw.time)
+	    add_touched (touched, touched_num, as);
 	}
-      break;
+
+      moved_x = speed_x*sw.time / sw.den;
+      moved_y = speed_y*sw.time / sw.den;
+      box.x += moved_x;
+      box.y += moved_y;
+
+      axes = sw.axes ? sw.axes : get_corner_axes (box, speed_x, speed_y,
+						  full_obstacles,
+						  half_obstacles);
+      speed_x = axes & SWEEP_X ? 0 : speed_x-moved_x;
+      speed_y = axes & SWEEP_Y ? 0 : speed_y-moved_y;
     }
 
-  return 0;
+  return box;
 }
 
 
-int
-is_closer (enum facing facing, SDL_Rect rect1, SDL_Rect rect2)
+SDL_Rect
+check_boundary (SDL_Rect charbox, int speed_x, int speed_y, SDL_Rect walkable)
 {
-  switch (facing)
-    {
-    case FACING_DOWN:
-      return rect1.y<rect2.y;
-    case FACING_UP:
-      return rect1.y>rect2.y;
-    case FACING_RIGHT:
-      return rect1.x<rect2.x;
-    case FACING_LEFT:
-      return rect1.x>rect2.x;
-    }
+  if (charbox.x+charbox.w > walkable.w)
+    charbox.x = walkable.w-charbox.w;
 
-  return 0;
+  if (charbox.x < 0)
+    charbox.x = 0;
+
+  if (charbox.y+charbox.h > walkable.h)
+    charbox.y = walkable.h-charbox.h;
+
+  if (charbox.y < 0)
+    charbox.y = 0;
+
+  return charbox;
 }
 
 
 SDL_Rect
-get_shot_rect (SDL_Rect charbox, enum facing facing, struct server_area *area,
-	       struct agent *as, int *hit, struct agent **shotag)
+move_character (struct player *pl, SDL_Rect walkable,
+		const struct obstacle_index *full_obstacles,
+		const struct obstacle_index *half_obstacles,
+		const struct agent_grid *agents, struct timer_wheel *timers,
+		int *character_hit)
 {
-  int i, dist;
-  SDL_Rect ret, hitpart;
+  struct agent *touched [MAX_TOUCHED];
+  int touched_num, i;
+  SDL_Rect charbox;
 
-  *hit = 0, *shotag = NULL;
+  *character_hit = 0;
 
-  for (i = 0; i < area->full_obstacles_num; i++)
-    {
-      if (is_target_hit (charbox, facing, area->full_obstacles [i], 0, &dist,
-			 &hitpart) && dist <= GUN_RANGE)
-	{
-	  if (!*hit || is_closer (facing, hitpart, ret))
-	    {
-	      *hit = 1;
-	      ret = hitpart;
-	    }
-	}
-    }
+  if (!pl->speed_x && !pl->speed_y)
+    return pl->agent->place;
 
-  while (as)
+  charbox = slide_box (pl->agent->place, pl->speed_x, pl->speed_y,
+		       full_obstacles, half_obstacles, agents, AGENT_ZOMBIE,
+		       touched, &touched_num);
+
+  for (i = 0; i < touched_num; i++)
     {
-      if (area == as->area
-	  && is_target_hit (charbox, facing, as->place, 1, &dist, &hitpart)
-	  && dist <= GUN_RANGE)
+      if (!is_timer_pending (&pl->agent->immortal))
 	{
-	  if (!*hit || is_closer (facing, hitpart, ret))
-	    {
-	      *hit = 1;
-	      *shotag = as;
-	      ret = hitpart;
-	    }
+	  start_timer (timers, &pl->agent->immortal, IMMORTAL_DURATION);
+	  pl->agent->life -= touched [i]->data_ptr.zombie->type == ZOMBIE_WALKER
+	    ? TOUCH_DAMAGE_FROM_WALKER : TOUCH_DAMAGE_FROM_BLOB;
+	  start_timer (timers, &pl->freeze, 6);
+	  pl->speed_x = -pl->speed_x*2;
+	  pl->speed_y = -pl->speed_y*2;
 	}
 
-      as = as->next;
+      *character_hit = 1;
     }
 
-  if (*hit)
-    {
-      ret.w = GRID_CELL_W;
-      ret.h = GRID_CELL_H;
-    }
-  else switch (facing)
-    {
-    case FACING_DOWN:
-      if (area->walkable.h-charbox.h-charbox.y <= GUN_RANGE)
+  return check_boundary (charbox, pl->speed_x, pl->speed_y, walkable);
+}
+
+
+SDL_Rect
+move_zombie (SDL_Rect charbox, int speed_x, int speed_y, SDL_Rect walkable,
+	     const struct obstacle_index *full_obstacles,
+	     const struct obstacle_index *half_obstacles,
+	     const struct agent_grid *agents, enum zombie_type zt,
+	     struct timer_wheel *timers)
+{
+  struct agent *touched [MAX_TOUCHED];
+  int touched_num, i;
+  struct player *pl;
+
+  if (!speed_x && !speed_y)
+    return charbox;
+
+  charbox = slide_box (charbox, speed_x, speed_y, full_obstacles,
+		       half_obstacles, agents, AGENT_PLAYER, touched,
+		       &touched_num);
+
+  for (i = 0; i < touched_num; i++)
+    {
+      pl = touched [i]->data_ptr.player;
+
+      if (!is_timer_pending (&touched [i]->immortal))
 	{
-	  *hit = 1;
-	  ret.x = charbox.x;
-	  ret.y = area->walkable.h;
+	  start_timer (timers, &touched [i]->immortal, IMMORTAL_DURATION);
+	  touched [i]->life -= zt == ZOMBIE_WALKER
+	    ? TOUCH_DAMAGE_FROM_WALKER : TOUCH_DAMAGE_FROM_BLOB;
+	  start_timer (timers, &pl->freeze, 6);
+	  pl->speed_x = speed_x*4;
+	  pl->speed_y = speed_y*4;
 	}
-      break;
-    case FACING_UP:
-      if (charbox.y <= GUN_RANGE)
+    }
+
+  return check_boundary (charbox, speed_x, speed_y, walkable);
+}
+
+
+void
+init_player_index (struct server_area *area)
+{
+  struct player_index *idx = &area->players;
+
+  idx->cols = area->walkable.w / PLAYER_CELL_SIZE + 1;
+  idx->rows = area->walkable.h / PLAYER_CELL_SIZE + 1;
+  idx->start = calloc_and_check (idx->cols*idx->rows+1, sizeof (*idx->start));
+  idx->items = malloc_and_check (sizeof (*idx->items) * MAX_PLAYERS);
+}
+
+
+void
+get_player_cell (const struct player_index *idx, SDL_Rect place, int *col,
+		 int *row)
+{
+  *col = place.x < 0 ? 0 : place.x / PLAYER_CELL_SIZE;
+  *row = place.y < 0 ? 0 : place.y / PLAYER_CELL_SIZE;
+
+  if (*col >= idx->cols)
+    *col = idx->cols-1;
+
+  if (*row >= idx->rows)
+    *row = idx->rows-1;
+}
+
+
+/* a counting sort of the players in area by cell.  Each start [c] is
+   first the end of cell c-1 and then moved back to the start of c */
+void
+index_players (struct server_area *area, struct player players [])
+{
+  struct player_index *idx = &area->players;
+  int cells = idx->cols*idx->rows, col, row, i;
+
+  memset (idx->start, 0, sizeof (*idx->start) * (cells+1));
+
+  for (i = 0; i < MAX_PLAYERS; i++)
+    {
+      if (players [i].id != -1 && players [i].agent->area == area)
 	{
-	  *hit = 1;
-	  ret.x = charbox.x;
-	  ret.y = -GRID_CELL_H;
+	  get_player_cell (idx, players [i].agent->place, &col, &row);
+	  idx->start [row*idx->cols+col+1]++;
 	}
-      break;
-    case FACING_RIGHT:
-      if (area->walkable.w-charbox.w-charbox.x <= GUN_RANGE)
+    }
+
+  for (i = 0; i < cells; i++)
+    idx->start [i+1] += idx->start [i];
+
+  for (i = 0; i < MAX_PLAYERS; i++)
+    {
+      if (players [i].id != -1 && players [i].agent->area == area)
 	{
-	  *hit = 1;
-	  ret.x = area->walkable.w;
-	  ret.y = charbox.y;
+	  get_player_cell (idx, players [i].agent->place, &col, &row);
+	  idx->items [idx->start [row*idx->cols+col]++] = players [i].agent;
 	}
-      break;
-    case FACING_LEFT:
-      if (charbox.x <= GUN_RANGE)
+    }
+
+  for (i = cells; i > 0; i--)
+    idx->start [i] = idx->start [i-1];
+
+  idx->start [0] = 0;
+}
+
+
+/* returns the id of the player of idx nearest to place, if it is less
+   than max_distance away, or -1.  Ties go to the lowest id */
+uint32_t
+find_nearest_player (const struct player_index *idx, SDL_Rect place,
+		     int max_distance, int *distance)
+{
+  struct agent *as;
+  uint32_t nearest = -1, id;
+  int col, row, r, end, i, dist;
+
+  get_player_cell (idx, place, &col, &row);
+
+  for (r = row > 0 ? row-1 : 0; r <= row+1 && r < idx->rows; r++)
+    {
+      end = idx->start [r*idx->cols + (col+1 < idx->cols ? col+2 : col+1)];
+
+      for (i = idx->start [r*idx->cols + (col > 0 ? col-1 : 0)]; i < end; i++)
 	{
-	  *hit = 1;
-	  ret.x = -GRID_CELL_W;
-	  ret.y = charbox.y;
+	  as = idx->items [i];
+	  id = as->data_ptr.player->id;
+	  dist = abs (place.x-as->place.x) + abs (place.y-as->place.y);
+
+	  if (dist < max_distance
+	      && (nearest == -1 || dist < *distance
+		  || (dist == *distance && id < nearest)))
+	    {
+	      nearest = id;
+	      *distance = dist;
+	    }
 	}
-      break;
     }
 
-  if (*hit) switch (facing)
+  return nearest;
+}
+
+
+/* the player that z chases, or NULL if it chases nobody or if the player
+   left, even if someone else took the same slot since */
+struct player *
+get_zombie_target (const struct zombie *z, struct player players [])
+{
+  if (z->target == -1 || players [z->target].id == -1
+      || players [z->target].agent->id != z->target_agent)
+    return NULL;
+
+  return &players [z->target];
+}
+
+
+/* sets the target of every walker of area that thinks in this tick to
+   the nearest player in sight.  With nobody in sight, a walker keeps
+   chasing a player that went to another area, or that it followed through
+   a warp, and forgets any other.  The players must be indexed already */
+void
+target_nearest_players (struct server_area *area, struct player players [])
+{
+  struct zombie *z;
+  struct player *pl;
+  uint32_t nearest;
+  int dist;
+
+  for (z = area->zombies; z; z = z->next)
     {
-    case FACING_DOWN:
-      ret.y -= 8;
-      break;
-    case FACING_UP:
-      ret.y += 8;
-      break;
-    case FACING_RIGHT:
-      ret.x -= 8;
-      break;
-    case FACING_LEFT:
-      ret.x += 8;
-      break;
+      if (z->type != ZOMBIE_WALKER || is_timer_pending (&z->freeze)
+	  || is_timer_pending (&z->next_thinking))
+	continue;
+
+      nearest = find_nearest_player (&area->players, z->agent->place,
+				     ZOMBIE_SIGHT, &dist);
+
+      if (nearest != -1)
+	z->is_following = 0;
+
+      pl = get_zombie_target (z, players);
+
+      if (nearest != -1 || !pl
+	  || (pl->agent->area == area && !z->is_following))
+	{
+	  z->target = nearest;
+	  z->target_agent = nearest != -1 ? players [nearest].agent->id : 0;
+	}
     }
+}
 
-  return ret;
+
+void
+init_flow_field (struct server_area *area)
+{
+  struct flow_field *flow = &area->flow;
+  SDL_Rect cell;
+  int i;
+
+  flow->cols = area->walkable.w / FLOW_CELL_SIZE + 1;
+  flow->rows = area->walkable.h / FLOW_CELL_SIZE + 1;
+  flow->blocked = malloc_and_check (flow->cols*flow->rows);
+  flow->distance = malloc_and_check (sizeof (*flow->distance)
+				     * flow->cols*flow->rows);
+  flow->queue = malloc_and_check (sizeof (*flow->queue)
+				  * flow->cols*flow->rows);
+  flow->reached_num = 0;
+  flow->seeds = malloc_and_check (sizeof (*flow->seeds) * MAX_PLAYERS);
+  flow->seeds_num = -1;
+
+  for (i = 0; i < flow->cols*flow->rows; i++)
+    {
+      set_rect (&cell, i%flow->cols*FLOW_CELL_SIZE, i/flow->cols*FLOW_CELL_SIZE,
+		FLOW_CELL_SIZE, FLOW_CELL_SIZE);
+      flow->blocked [i] = !is_rect_free (cell, 0, 0, &area->full_index)
+	|| !is_rect_free (cell, 0, 0, &area->half_index);
+      flow->distance [i] = FLOW_UNREACHED;
+    }
 }
 
 
-struct agent *
-get_stabbed_agent (SDL_Rect charbox, enum facing facing,
-		   struct server_area *area, struct agent *as, int *speed_x,
-		   int *speed_y)
+int
+get_flow_cell (const struct flow_field *flow, SDL_Rect box)
+{
+  int col = (box.x+box.w/2) / FLOW_CELL_SIZE,
+    row = (box.y+box.h/2) / FLOW_CELL_SIZE;
+
+  col = col < 0 ? 0 : col >= flow->cols ? flow->cols-1 : col;
+  row = row < 0 ? 0 : row >= flow->rows ? flow->rows-1 : row;
+
+  return row*flow->cols+col;
+}
+
+
+/* fills distance breadth-first from the cells already at 0, which are
+   queue [0] to queue [*queue_num-1], up to range steps.  Afterwards queue
+   holds all the cells reached */
+void
+spread_distance (const struct flow_field *flow, uint16_t *distance,
+		 int *queue, int *queue_num, int range)
 {
-  struct agent *ret = NULL;
-  int dist, shift, retdist, retshift;
+  int steps [4] = {-1, 1, -flow->cols, flow->cols}, head, c, n, i;
 
-  while (as)
+  for (head = 0; head < *queue_num; head++)
     {
-      if (as->area == area)
+      c = queue [head];
+
+      if (distance [c] == range)
+	continue;
+
+      for (i = 0; i < 4; i++)
 	{
-	  switch (facing)
-	    {
-	    case FACING_DOWN:
-	    case FACING_UP:
-	      dist = abs (charbox.y-as->place.y);
-	      shift = as->place.x-charbox.x;
-	      break;
-	    case FACING_RIGHT:
-	    case FACING_LEFT:
-	      dist = abs (charbox.x-as->place.x);
-	      shift = as->place.y-charbox.y;
-	      break;
-	    }
+	  n = c+steps [i];
 
-	  if (0 < dist && dist < 20 && abs (shift) < 8)
-	    {
-	      if (!ret || (dist < retdist && abs (shift) < abs (retshift)))
-		{
-		  ret = as;
-		  retdist = dist;
-		  retshift = shift;
-		}
-	    }
+	  if ((i == 0 && c%flow->cols == 0)
+	      || (i == 1 && c%flow->cols == flow->cols-1)
+	      || n < 0 || n >= flow->cols*flow->rows
+	      || flow->blocked [n] || distance [n] != FLOW_UNREACHED)
+	    continue;
+
+	  distance [n] = distance [c]+1;
+	  queue [(*queue_num)++] = n;
 	}
+    }
+}
+
+
+/* breadth-first from the cells of the players in area, after undoing
+   the previous search */
+void
+update_flow_field (struct server_area *area, struct player players [])
+{
+  struct flow_field *flow = &area->flow;
+  int seeds [MAX_PLAYERS], seeds_num = 0, i;
 
-      as = as->next;
+  for (i = 0; i < MAX_PLAYERS; i++)
+    {
+      if (players [i].id != -1 && players [i].agent->area == area)
+	seeds [seeds_num++] = get_flow_cell (flow, players [i].agent->place);
     }
 
-  if (ret)
+  if (seeds_num == flow->seeds_num
+      && !memcmp (seeds, flow->seeds, sizeof (*seeds) * seeds_num))
+    return;
+
+  memcpy (flow->seeds, seeds, sizeof (*seeds) * seeds_num);
+  flow->seeds_num = seeds_num;
+
+  for (i = 0; i < flow->reached_num; i++)
+    flow->distance [flow->queue [i]] = FLOW_UNREACHED;
+
+  flow->reached_num = 0;
+
+  for (i = 0; i < seeds_num; i++)
     {
-      switch (facing)
+      if (flow->distance [seeds [i]] == FLOW_UNREACHED)
 	{
-	case FACING_DOWN:
-	case FACING_UP:
-	  *speed_y = 4 * (facing == FACING_UP ? -1 : 1);
-	  *speed_x = abs (retshift) < 2 ? 0
-	    : abs (retshift) < 4 ? SIGN (retshift)
-	    : abs (retshift) < 6 ? 2 * SIGN (retshift) : 3 * SIGN (retshift);
-	  break;
-	case FACING_RIGHT:
-	case FACING_LEFT:
-	  *speed_x = 4 * (facing == FACING_LEFT ? -1 : 1);
-	  *speed_y = abs (retshift) < 2 ? 0
-	    : abs (retshift) < 4 ? SIGN (retshift)
-	    : abs (retshift) < 6 ? 2 * SIGN (retshift) : 3 * SIGN (retshift);
-	  break;
+	  flow->distance [seeds [i]] = 0;
+	  flow->queue [flow->reached_num++] = seeds [i];
 	}
     }
 
-  return ret;
+  spread_distance (flow, flow->distance, flow->queue, &flow->reached_num,
+		  FLOW_RANGE);
 }
 
 
-int
-does_character_face_object (SDL_Rect character, enum facing facing,
-			    SDL_Rect square)
+void
+steer_straight (struct zombie *z, SDL_Rect target)
 {
-  switch (facing)
+  if (z->agent->place.x != target.x)
     {
-    case FACING_DOWN:
-      if (character.x > square.x-square.w/2 && character.x < square.x+square.w*3/2
-	  && character.y+character.h == square.y)
-	return 1;
-      break;
-    case FACING_UP:
-      if (character.x > square.x-square.w/2 && character.x < square.x+square.w*3/2
-	  && character.y == square.y+square.h)
-	return 1;
-      break;
-    case FACING_RIGHT:
-      if (character.y > square.y-square.h/2 && character.y < square.y+square.h*3/2
-	  && character.x+character.w == square.x)
-	return 1;
-      break;
-    case FACING_LEFT:
-      if (character.y > square.y-square.h/2 && character.y < square.y+square.h*3/2
-	  && character.x == square.x+square.w)
-	return 1;
-      break;
+      z->speed_x = ZOMBIE_WALKER_SPEED
+	* (z->agent->place.x > target.x ? -1 : 1);
+      z->facing = z->speed_x > 0 ? FACING_RIGHT : FACING_LEFT;
     }
+  else
+    z->speed_x = 0;
 
-  return 0;
+  if (z->agent->place.y != target.y)
+    {
+      z->speed_y = ZOMBIE_WALKER_SPEED
+	* (z->agent->place.y > target.y ? -1 : 1);
+      z->facing = z->speed_y > 0 ? FACING_DOWN : FACING_UP;
+    }
+  else
+    z->speed_y = 0;
+}
+
+
+/* points z so that its center moves towards x, y by at most
+   ZOMBIE_WALKER_SPEED on each axis */
+void
+steer_towards (struct zombie *z, int x, int y)
+{
+  z->speed_x = x - (z->agent->place.x+z->agent->place.w/2);
+  z->speed_y = y - (z->agent->place.y+z->agent->place.h/2);
+
+  z->speed_x = z->speed_x > ZOMBIE_WALKER_SPEED ? ZOMBIE_WALKER_SPEED
+    : z->speed_x < -ZOMBIE_WALKER_SPEED ? -ZOMBIE_WALKER_SPEED : z->speed_x;
+  z->speed_y = z->speed_y > ZOMBIE_WALKER_SPEED ? ZOMBIE_WALKER_SPEED
+    : z->speed_y < -ZOMBIE_WALKER_SPEED ? -ZOMBIE_WALKER_SPEED : z->speed_y;
+
+  if (z->speed_x)
+    z->facing = z->speed_x > 0 ? FACING_RIGHT : FACING_LEFT;
+
+  if (z->speed_y)
+    z->facing = z->speed_y > 0 ? FACING_DOWN : FACING_UP;
 }
 
 
+/* points z to the center of the neighbor cell with the least distance,
+   never cutting the corner of a blocked cell.  Returns 0 if the cell of z
+   is out of reach of distance or already at 0 */
 int
-does_agent_take_object (SDL_Rect charbox, SDL_Rect objbox)
+steer_by_flow (struct zombie *z, const struct flow_field *flow,
+	       const uint16_t *distance)
 {
-  SDL_Rect inters;
+  int c = get_flow_cell (flow, z->agent->place), col = c % flow->cols,
+    row = c / flow->cols, best = distance [c], next = -1, dc, dr, n;
 
-  return SDL_IntersectRect (&charbox, &objbox, &inters)
-    && inters.w > GRID_CELL_W/2 && inters.h > GRID_CELL_H/2;
+  if (best == FLOW_UNREACHED || !best)
+    return 0;
+
+  for (dr = -1; dr <= 1; dr++)
+    {
+      for (dc = -1; dc <= 1; dc++)
+	{
+	  if (col+dc < 0 || col+dc >= flow->cols || row+dr < 0
+	      || row+dr >= flow->rows)
+	    continue;
+
+	  n = c + dr*flow->cols + dc;
+
+	  if (distance [n] >= best
+	      || (dc && dr && (flow->blocked [c+dc]
+			       || flow->blocked [c+dr*flow->cols])))
+	    continue;
+
+	  best = distance [n];
+	  next = n;
+	}
+    }
+
+  if (next == -1)
+    return 0;
+
+  steer_towards (z, next%flow->cols*FLOW_CELL_SIZE + FLOW_CELL_SIZE/2,
+		 next/flow->cols*FLOW_CELL_SIZE + FLOW_CELL_SIZE/2);
+  return 1;
 }
 
 
-void
-swap_objects (enum object_type *t1, enum object_type *t2)
+/* private areas have an instance per player, so zombies stay out */
+int
+can_zombies_enter (const struct server_area *area)
 {
-  enum object_type tmp = *t1;
-  *t1 = *t2;
-  *t2 = tmp;
+  return !area->is_private;
 }
 
 
-int
-is_visible_by_player (SDL_Rect charbox, SDL_Rect entity)
-{
-  return abs (charbox.x-entity.x) < WINDOW_WIDTH
-    && abs (charbox.y-entity.y) < WINDOW_HEIGHT;
+/* computes the distance field of each warp and then the route costs,
+   relaxing them until no route through another warp is shorter.  Areas
+   are linked by a handful of warps, so this takes a few rounds at
+   startup; obstacles never change, so neither does the result */
+void
+init_warp_routes (struct server_area *areas)
+{
+  struct server_area *area;
+  struct warp *w, *x;
+  SDL_Rect box;
+  int areas_num = 0, queue_num, spawn, cost, changed, col0, row0, col1, row1,
+    c, r, i;
+
+  for (area = areas; area; area = area->next)
+    areas_num = area->id >= areas_num ? area->id+1 : areas_num;
+
+  for (area = areas; area; area = area->next)
+    {
+      for (w = area->warps; w; w = w->next)
+	{
+	  w->distance = malloc_and_check (sizeof (*w->distance)
+					  * area->flow.cols*area->flow.rows);
+
+	  for (i = 0; i < area->flow.cols*area->flow.rows; i++)
+	    w->distance [i] = FLOW_UNREACHED;
+
+	  col0 = w->place.x / FLOW_CELL_SIZE;
+	  row0 = w->place.y / FLOW_CELL_SIZE;
+	  col1 = (w->place.x+w->place.w-1) / FLOW_CELL_SIZE;
+	  row1 = (w->place.y+w->place.h-1) / FLOW_CELL_SIZE;
+	  queue_num = 0;
+
+	  for (r = row0; r <= row1 && r < area->flow.rows; r++)
+	    {
+	      for (c = col0; c <= col1 && c < area->flow.cols; c++)
+		{
+		  w->distance [r*area->flow.cols+c] = 0;
+		  area->flow.queue [queue_num++] = r*area->flow.cols+c;
+		}
+	    }
+
+	  spread_distance (&area->flow, w->distance, area->flow.queue,
+			   &queue_num, FLOW_UNREACHED);
+
+	  w->route_costs = malloc_and_check (sizeof (*w->route_costs)
+					     * areas_num);
+
+	  for (i = 0; i < areas_num; i++)
+	    w->route_costs [i] = INT_MAX;
+
+	  if (can_zombies_enter (w->dest))
+	    w->route_costs [w->dest->id] = 1;
+	}
+    }
+
+  do
+    {
+      changed = 0;
+
+      for (area = areas; area; area = area->next)
+	{
+	  for (w = area->warps; w; w = w->next)
+	    {
+	      if (!can_zombies_enter (w->dest))
+		continue;
+
+	      set_rect (&box, w->spawn.x, w->spawn.y, GRID_CELL_W, GRID_CELL_H);
+	      spawn = get_flow_cell (&w->dest->flow, box);
+
+	      for (x = w->dest->warps; x; x = x->next)
+		{
+		  if (x->distance [spawn] == FLOW_UNREACHED)
+		    continue;
+
+		  for (i = 0; i < areas_num; i++)
+		    {
+		      if (x->route_costs [i] == INT_MAX)
+			continue;
+
+		      cost = 1 + x->distance [spawn] + x->route_costs [i];
+
+		      if (cost < w->route_costs [i])
+			{
+			  w->route_costs [i] = cost;
+			  changed = 1;
+			}
+		    }
+		}
+	    }
+	}
+    } while (changed);
+}
+
+
+/* the warp through which z can reach dest in the fewest steps, or NULL */
+struct warp *
+find_exit_warp (struct zombie *z, const struct server_area *dest)
+{
+  struct server_area *area = z->agent->area;
+  struct warp *w, *ret = NULL;
+  int c = get_flow_cell (&area->flow, z->agent->place), best = INT_MAX, cost;
+
+  for (w = area->warps; w; w = w->next)
+    {
+      if (w->distance [c] == FLOW_UNREACHED
+	  || w->route_costs [dest->id] == INT_MAX)
+	continue;
+
+      cost = w->distance [c] + w->route_costs [dest->id];
+
+      if (cost < best)
+	{
+	  best = cost;
+	  ret = w;
+	}
+    }
+
+  return ret;
+}
+
+
+/* steers z towards the player it chases, through the warps that lead to
+   the area of the player if it is elsewhere.  Returns 0 and forgets the
+   player if it cannot be reached */
+int
+chase_target (struct zombie *z, struct player players [])
+{
+  struct player *pl = get_zombie_target (z, players);
+  struct server_area *area = z->agent->area;
+  struct warp *w;
+
+  if (pl && pl->agent->area == area)
+    {
+      if (!steer_by_flow (z, &area->flow, area->flow.distance))
+	steer_straight (z, pl->agent->place);
+
+      return 1;
+    }
+
+  if (!pl || !(w = find_exit_warp (z, pl->agent->area)))
+    {
+      z->target = -1;
+      return 0;
+    }
+
+  if (!steer_by_flow (z, &area->flow, w->distance))
+    steer_towards (z, w->place.x+z->agent->place.w/2,
+		   w->place.y+z->agent->place.h/2);
+
+  return 1;
+}
+
+
+/* the warp that z stands on, if it chases a player in another area and
+   zombies may go where the warp leads */
+struct warp *
+get_zombie_warp (struct zombie *z, struct player players [])
+{
+  struct player *pl = get_zombie_target (z, players);
+  struct warp *w;
+
+  if (!pl || pl->agent->area == z->agent->area)
+    return NULL;
+
+  for (w = z->agent->area->warps; w; w = w->next)
+    {
+      if (IS_RECT_CONTAINED (z->agent->place, w->place)
+	  && can_zombies_enter (w->dest))
+	return w;
+    }
+
+  return NULL;
+}
+
+
+int
+is_target_hit (SDL_Rect charbox, enum facing facing, SDL_Rect target,
+	       int is_agent, int *distance, SDL_Rect *hitpart)
+{
+  switch (facing)
+    {
+    case FACING_DOWN:
+      if (charbox.y<target.y
+	  && target.x<=charbox.x+charbox.w/2
+	  && charbox.x+charbox.w/2 <= target.x+target.w)
+	{
+	  hitpart->x = charbox.x;
+	  hitpart->y = target.y;
+	  *distance = target.y-charbox.h-charbox.y;
+	  return 1;
+	}
+      break;
+    case FACING_UP:
+      if ((charbox.y>target.y || (!is_agent && charbox.y==target.y))
+	  && target.x<=charbox.x+charbox.w/2
+	  && charbox.x+charbox.w/2 <= target.x+target.w)
+	{
+	  hitpart->x = charbox.x;
+	  hitpart->y = target.y+target.h-GRID_CELL_H;
+	  *distance = charbox.y-target.h-target.y;
+	  return 1;
+	}
+      break;
+    case FACING_RIGHT:
+      if (charbox.x<target.x
+	  && target.y<=charbox.y+charbox.h/2
+	  && charbox.y+charbox.h/2 <= target.y+target.h)
+	{
+	  hitpart->x = target.x;
+	  hitpart->y = charbox.y;
+	  *distance = target.x-charbox.w-charbox.x;
+	  return 1;
+	}
+      break;
+    case FACING_LEFT:
+      if ((charbox.x>target.x || (!is_agent && charbox.x==target.x))
+	  && target.y<=charbox.y+charbox.h/2
+	  && charbox.y+charbox.h/2 <= target.y+target.h)
+	{
+	  hitpart->x = target.x+target.w-GRID_CELL_W;
+	  hitpart->y = charbox.y;
+	  *distance = charbox.x-target.w-target.x;
+	  return 1;
+	}
+      break;
+    }
+
+  return 0;
+}
+
+
+int
+is_closer (enum facing facing, SDL_Rect rect1, SDL_Rect rect2)
+{
+  switch (facing)
+    {
+    case FACING_DOWN:
+      return rect1.y<rect2.y;
+    case FACING_UP:
+      return rect1.y>rect2.y;
+    case FACING_RIGHT:
+      return rect1.x<rect2.x;
+    case FACING_LEFT:
+      return rect1.x>rect2.x;
+    }
+
+  return 0;
+}
+
+
+int
+floor_div (int a, int b)
+{
+  return a < 0 ? -1 - (-1-a) / b : a / b;
+}
+
+
+/* whether a shot whose closest hit so far is ret can stop after band: no
+   obstacle or agent first found in later bands can be closer.  Agents are
+   found by their top left corner, so a hit on one can come back by up to
+   MAX_AGENT_SIZE */
+int
+is_shot_stopped (enum facing facing, SDL_Rect ret, int band)
+{
+  switch (facing)
+    {
+    case FACING_DOWN:
+      return ret.y < (band+1)*AGENT_CELL_SIZE;
+    case FACING_UP:
+      return ret.y >= band*AGENT_CELL_SIZE+MAX_AGENT_SIZE-GRID_CELL_H-1;
+    case FACING_RIGHT:
+      return ret.x < (band+1)*AGENT_CELL_SIZE;
+    case FACING_LEFT:
+      return ret.x >= band*AGENT_CELL_SIZE+MAX_AGENT_SIZE-GRID_CELL_W-1;
+    }
+
+  return 1;
+}
+
+
+/* walks the line of fire in bands of AGENT_CELL_SIZE pixels, from the
+   shooter outwards, and stops as soon as no later band can hold a closer
+   hit */
+SDL_Rect
+get_shot_rect (SDL_Rect charbox, enum facing facing, struct server_area *area,
+	       const struct agent_grid *agents, int *hit, struct agent **shotag)
+{
+  int dist, band, first, last, vertical, forward,
+    cx = charbox.x+charbox.w/2, cy = charbox.y+charbox.h/2;
+  struct obstacle_iter oit;
+  struct agent_iter ait;
+  struct agent *as;
+  SDL_Rect ret, hitpart = {0}, *ob, segment;
+
+  *hit = 0, *shotag = NULL;
+
+  vertical = facing == FACING_DOWN || facing == FACING_UP;
+  forward = facing == FACING_DOWN || facing == FACING_RIGHT;
+
+  if (vertical)
+    {
+      first = floor_div (charbox.y, AGENT_CELL_SIZE);
+      last = forward
+	? floor_div (charbox.y+charbox.h+GUN_RANGE, AGENT_CELL_SIZE)
+	: floor_div (charbox.y-GUN_RANGE-MAX_AGENT_SIZE, AGENT_CELL_SIZE);
+    }
+  else
+    {
+      first = floor_div (charbox.x, AGENT_CELL_SIZE);
+      last = forward
+	? floor_div (charbox.x+charbox.w+GUN_RANGE, AGENT_CELL_SIZE)
+	: floor_div (charbox.x-GUN_RANGE-MAX_AGENT_SIZE, AGENT_CELL_SIZE);
+    }
+
+  for (band = first; ; band += forward ? 1 : -1)
+    {
+      if (vertical)
+	{
+	  set_rect (&segment, cx, band*AGENT_CELL_SIZE, 0, AGENT_CELL_SIZE-1);
+	  init_agent_iter (&ait, agents, cx-MAX_AGENT_SIZE,
+			   segment.y, cx, segment.y+segment.h);
+	}
+      else
+	{
+	  set_rect (&segment, band*AGENT_CELL_SIZE, cy, AGENT_CELL_SIZE-1, 0);
+	  init_agent_iter (&ait, agents, segment.x,
+			   cy-MAX_AGENT_SIZE, segment.x+segment.w, cy);
+	}
+
+      init_obstacle_iter (&oit, &area->full_index, segment);
+
+      while ((ob = next_obstacle (&oit)))
+	{
+	  if (is_target_hit (charbox, facing, *ob, 0, &dist, &hitpart)
+	      && dist <= GUN_RANGE)
+	    {
+	      if (!*hit || is_closer (facing, hitpart, ret))
+		{
+		  *hit = 1;
+		  *shotag = NULL;
+		  ret = hitpart;
+		}
+	    }
+	}
+
+      while ((as = next_agent (&ait)))
+	{
+	  if (is_target_hit (charbox, facing, as->place, 1, &dist, &hitpart)
+	      && dist <= GUN_RANGE)
+	    {
+	      if (!*hit || is_closer (facing, hitpart, ret))
+		{
+		  *hit = 1;
+		  *shotag = as;
+		  ret = hitpart;
+		}
+	    }
+	}
+
+      if (band == last || (*hit && is_shot_stopped (facing, ret, band)))
+	break;
+    }
+
+  if (*hit)
+    {
+      ret.w = GRID_CELL_W;
+      ret.h = GRID_CELL_H;
+    }
+  else switch (facing)
+    {
+    case FACING_DOWN:
+      if (area->walkable.h-charbox.h-charbox.y <= GUN_RANGE)
+	{
+	  *hit = 1;
+	  ret.x = charbox.x;
+	  ret.y = area->walkable.h;
+	}
+      break;
+    case FACING_UP:
+      if (charbox.y <= GUN_RANGE)
+	{
+	  *hit = 1;
+	  ret.x = charbox.x;
+	  ret.y = -GRID_CELL_H;
+	}
+      break;
+    case FACING_RIGHT:
+      if (area->walkable.w-charbox.w-charbox.x <= GUN_RANGE)
+	{
+	  *hit = 1;
+	  ret.x = area->walkable.w;
+	  ret.y = charbox.y;
+	}
+      break;
+    case FACING_LEFT:
+      if (charbox.x <= GUN_RANGE)
+	{
+	  *hit = 1;
+	  ret.x = -GRID_CELL_W;
+	  ret.y = charbox.y;
+	}
+      break;
+    }
+
+  if (*hit) switch (facing)
+    {
+    case FACING_DOWN:
+      ret.y -= 8;
+      break;
+    case FACING_UP:
+      ret.y += 8;
+      break;
+    case FACING_RIGHT:
+      ret.x -= 8;
+      break;
+    case FACING_LEFT:
+      ret.x += 8;
+      break;
+    }
+
+  return ret;
+}
+
+
+struct agent *
+get_stabbed_agent (SDL_Rect charbox, enum facing facing,
+		   const struct agent_grid *agents, int *speed_x, int *speed_y)
+{
+  struct agent *ret = NULL, *as;
+  struct agent_iter it;
+  int dist = 0, shift = 0, retdist, retshift = 0;
+
+  find_agents_near (&it, agents, charbox, 20);
+
+  while ((as = next_agent (&it)))
+    {
+      switch (facing)
+	{
+	case FACING_DOWN:
+	case FACING_UP:
+	  dist = abs (charbox.y-as->place.y);
+	  shift = as->place.x-charbox.x;
+	  break;
+	case FACING_RIGHT:
+	case FACING_LEFT:
+	  dist = abs (charbox.x-as->place.x);
+	  shift = as->place.y-charbox.y;
+	  break;
+	}
+
+      if (0 < dist && dist < 20 && abs (shift) < 8)
+	{
+	  if (!ret || (dist < retdist && abs (shift) < abs (retshift)))
+	    {
+	      ret = as;
+	      retdist = dist;
+	      retshift = shift;
+	    }
+	}
+    }
+
+  if (ret)
+    {
+      switch (facing)
+	{
+	case FACING_DOWN:
+	case FACING_UP:
+	  *speed_y = 4 * (facing == FACING_UP ? -1 : 1);
+	  *speed_x = abs (retshift) < 2 ? 0
+	    : abs (retshift) < 4 ? SIGN (retshift)
+	    : abs (retshift) < 6 ? 2 * SIGN (retshift) : 3 * SIGN (retshift);
+	  break;
+	case FACING_RIGHT:
+	case FACING_LEFT:
+	  *speed_x = 4 * (facing == FACING_LEFT ? -1 : 1);
+	  *speed_y = abs (retshift) < 2 ? 0
+	    : abs (retshift) < 4 ? SIGN (retshift)
+	    : abs (retshift) < 6 ? 2 * SIGN (retshift) : 3 * SIGN (retshift);
+	  break;
+	}
+    }
+
+  return ret;
+}
+
+
+int
+does_character_face_object (SDL_Rect character, enum facing facing,
+			    SDL_Rect square)
+{
+  switch (facing)
+    {
+    case FACING_DOWN:
+      if (character.x > square.x-square.w/2 && character.x < square.x+square.w*3/2
+	  && character.y+character.h == square.y)
+	return 1;
+      break;
+    case FACING_UP:
+      if (character.x > square.x-square.w/2 && character.x < square.x+square.w*3/2
+	  && character.y == square.y+square.h)
+	return 1;
+      break;
+    case FACING_RIGHT:
+      if (character.y > square.y-square.h/2 && character.y < square.y+square.h*3/2
+	  && character.x+character.w == square.x)
+	return 1;
+      break;
+    case FACING_LEFT:
+      if (character.y > square.y-square.h/2 && character.y < square.y+square.h*3/2
+	  && character.x == square.x+square.w)
+	return 1;
+      break;
+    }
+
+  return 0;
+}
+
+
+int
+does_agent_take_object (SDL_Rect charbox, SDL_Rect objbox)
+{
+  SDL_Rect inters;
+
+  return SDL_IntersectRect (&charbox, &objbox, &inters)
+    && inters.w > GRID_CELL_W/2 && inters.h > GRID_CELL_H/2;
+}
+
+
+void
+swap_objects (enum object_type *t1, enum object_type *t2)
+{
+  enum object_type tmp = *t1;
+  *t1 = *t2;
+  *t2 = tmp;
+}
+
+
+int
+is_visible_by_player (SDL_Rect charbox, SDL_Rect entity)
+{
+  return abs (charbox.x-entity.x) < WINDOW_WIDTH
+    && abs (charbox.y-entity.y) < WINDOW_HEIGHT;
+}
+
+
+void
+make_agent_visible (struct visible *vis, const struct agent *as)
+{
+  memset (vis, 0, sizeof (*vis));
+  vis->id = as->id;
+  vis->x = as->place.x;
+  vis->y = as->place.y;
+  vis->w = as->place.w;
+  vis->h = as->place.h;
+
+  if (as->type == AGENT_PLAYER)
+    {
+      vis->type = VISIBLE_PLAYER;
+      vis->subtype = as->data_ptr.player->bodytype;
+      vis->facing = as->data_ptr.player->facing;
+      vis->speed_x = as->data_ptr.player->speed_x;
+      vis->speed_y = as->data_ptr.player->speed_y;
+    }
+  else
+    {
+      vis->type = VISIBLE_ZOMBIE;
+      vis->subtype = as->data_ptr.zombie->type;
+      vis->facing = as->data_ptr.zombie->facing;
+      vis->speed_x = as->data_ptr.zombie->speed_x;
+      vis->speed_y = as->data_ptr.zombie->speed_y;
+      vis->is_immortal = is_timer_pending (&as->immortal);
+    }
+}
+
+
+/* returns 0 if the agent shows no icon */
+int
+make_searching_visible (struct visible *vis, const struct agent *as)
+{
+  struct player *pl = as->data_ptr.player;
+
+  if (as->type != AGENT_PLAYER || !pl->is_searching || !pl->might_search_at
+      || pl->might_search_at->searched_by != pl)
+    return 0;
+
+  memset (vis, 0, sizeof (*vis));
+  vis->id = VISIBLE_ID_ICON | as->id;
+  vis->type = VISIBLE_SEARCHING;
+  vis->x = as->place.x+12;
+  vis->y = as->place.y-16;
+  vis->w = 16;
+  vis->h = 16;
+  return 1;
+}
+
+
+/* returns 0 if obj is not shown */
+int
+make_object_visible (struct visible *vis, const struct object *obj)
+{
+  memset (vis, 0, sizeof (*vis));
+
+  switch (obj->type)
+    {
+    case OBJECT_HEALTH:
+      vis->type = VISIBLE_HEALTH;
+      break;
+    case OBJECT_AMMO:
+      vis->type = VISIBLE_AMMO;
+      break;
+    case OBJECT_FOOD:
+      vis->type = VISIBLE_FOOD;
+      break;
+    case OBJECT_WATER:
+      vis->type = VISIBLE_WATER;
+      break;
+    case OBJECT_FLESH:
+      vis->type = VISIBLE_FLESH;
+      break;
+    default:
+      return 0;
+    }
+
+  vis->id = obj->id;
+  vis->x = obj->place.x;
+  vis->y = obj->place.y;
+  vis->w = obj->place.w;
+  vis->h = obj->place.h;
+  return 1;
+}
+
+
+void
+make_shot_visible (struct visible *vis, const struct shot *s,
+		   const struct timer_wheel *timers)
+{
+  memset (vis, 0, sizeof (*vis));
+  vis->id = s->id;
+  vis->type = VISIBLE_SHOT;
+  vis->duration = get_timer_left (timers, &s->duration);
+  vis->x = s->target.x;
+  vis->y = s->target.y;
+  vis->w = s->target.w;
+  vis->h = s->target.h;
+}
+
+
+/* searching icons are shown together with their player */
+int
+is_cached_visible_seen (SDL_Rect charbox, const struct visible *vis)
+{
+  SDL_Rect place = {vis->x, vis->y, vis->w, vis->h};
+
+  if (vis->type == VISIBLE_SEARCHING)
+    {
+      place.x -= 12;
+      place.y += 16;
+    }
+
+  return is_visible_by_player (charbox, place);
+}
+
+
+struct server_area *
+find_area (struct server_area *areas, uint32_t id)
+{
+  while (areas && areas->id != id)
+    areas = areas->next;
+
+  return areas;
+}
+
+
+void
+init_cell_index (struct cell_index *ci, int cells)
+{
+  ci->start = calloc_and_check (cells+1, sizeof (*ci->start));
+  ci->fill = calloc_and_check (cells+1, sizeof (*ci->fill));
+  ci->items = NULL;
+  ci->capacity = 0;
+}
+
+
+void
+init_aoi_grid (struct server_area *area)
+{
+  struct aoi_grid *aoi = &area->aoi;
+
+  aoi->cols = (area->walkable.w+WINDOW_WIDTH-1) / WINDOW_WIDTH;
+  aoi->rows = (area->walkable.h+WINDOW_HEIGHT-1) / WINDOW_HEIGHT;
+
+  if (aoi->cols < 1)
+    aoi->cols = 1;
+
+  if (aoi->rows < 1)
+    aoi->rows = 1;
+
+  init_cell_index (&aoi->agents, aoi->cols*aoi->rows);
+  init_cell_index (&aoi->objects, aoi->cols*aoi->rows);
+  init_cell_index (&aoi->shots, aoi->cols*aoi->rows);
+
+  aoi->visibles = NULL;
+  aoi->visibles_start = calloc_and_check (aoi->cols*aoi->rows+1,
+					  sizeof (*aoi->visibles_start));
+  aoi->visibles_capacity = 0;
+}
+
+
+/* places outside the walkable rect go to the nearest border cell, which
+   keeps neighbouring places in neighbouring cells */
+int
+get_aoi_cell (const struct server_area *area, SDL_Rect place)
+{
+  int col = (place.x-area->walkable.x) / WINDOW_WIDTH,
+    row = (place.y-area->walkable.y) / WINDOW_HEIGHT;
+
+  col = col < 0 ? 0 : col >= area->aoi.cols ? area->aoi.cols-1 : col;
+  row = row < 0 ? 0 : row >= area->aoi.rows ? area->aoi.rows-1 : row;
+
+  return row*area->aoi.cols+col;
+}
+
+
+/* is_visible_by_player only accepts places less than a cell away on each
+   axis, so the cells around charbox contain all of them */
+int
+get_aoi_cells (const struct server_area *area, SDL_Rect charbox, int cells [9])
+{
+  int center = get_aoi_cell (area, charbox), col = center % area->aoi.cols,
+    row = center / area->aoi.cols, c, r, ret = 0;
+
+  for (r = row-1; r <= row+1; r++)
+    {
+      for (c = col-1; c <= col+1; c++)
+	{
+	  if (r >= 0 && r < area->aoi.rows && c >= 0 && c < area->aoi.cols)
+	    cells [ret++] = r*area->aoi.cols+c;
+	}
+    }
+
+  return ret;
+}
+
+
+/* the first pass counts the items of each cell, the second one stores
+   them */
+void
+index_item (struct cell_index *ci, int cell, void *item, int pass)
+{
+  if (!pass)
+    ci->start [cell+1]++;
+  else
+    ci->items [ci->fill [cell]++] = item;
+}
+
+
+void
+clear_cell_index (struct cell_index *ci, int cells)
+{
+  memset (ci->start, 0, sizeof (*ci->start) * (cells+1));
+}
+
+
+/* turns the counts into offsets and makes room for the items */
+void
+prepare_cell_index (struct cell_index *ci, int cells)
+{
+  int i;
+
+  for (i = 0; i < cells; i++)
+    ci->start [i+1] += ci->start [i];
+
+  if (ci->start [cells] > ci->capacity)
+    {
+      free (ci->items);
+      ci->capacity = ci->start [cells]*2;
+      ci->items = malloc_and_check (sizeof (*ci->items) * ci->capacity);
+    }
+
+  memcpy (ci->fill, ci->start, sizeof (*ci->fill) * cells);
+}
+
+
+/* makes the visibles of each cell of area from its indices */
+void
+cache_cell_visibles (struct server_area *area,
+		     const struct timer_wheel *timers)
+{
+  struct aoi_grid *aoi = &area->aoi;
+  int cells = aoi->cols*aoi->rows, max = 2*aoi->agents.start [cells]
+    + aoi->objects.start [cells] + aoi->shots.start [cells], c, k, n = 0;
+
+  if (max > aoi->visibles_capacity)
+    {
+      free (aoi->visibles);
+      aoi->visibles_capacity = max*2;
+      aoi->visibles = malloc_and_check (sizeof (*aoi->visibles)
+					* aoi->visibles_capacity);
+    }
+
+  for (c = 0; c < cells; c++)
+    {
+      aoi->visibles_start [c] = n;
+
+      for (k = aoi->agents.start [c]; k < aoi->agents.start [c+1]; k++)
+	{
+	  make_agent_visible (&aoi->visibles [n++], aoi->agents.items [k]);
+	  n += make_searching_visible (&aoi->visibles [n],
+				       aoi->agents.items [k]);
+	}
+
+      for (k = aoi->objects.start [c]; k < aoi->objects.start [c+1]; k++)
+	n += make_object_visible (&aoi->visibles [n], aoi->objects.items [k]);
+
+      for (k = aoi->shots.start [c]; k < aoi->shots.start [c+1]; k++)
+	make_shot_visible (&aoi->visibles [n++], aoi->shots.items [k], timers);
+    }
+
+  aoi->visibles_start [cells] = n;
+}
+
+
+void
+build_aoi (struct server_area *areas, struct object *objects,
+	   struct shot *shots, const struct timer_wheel *timers)
+{
+  struct server_area *area;
+  struct agent *as;
+  struct object *obj;
+  struct shot *s;
+  int pass, cells, i;
+
+  for (area = areas; area; area = area->next)
+    {
+      cells = area->aoi.cols*area->aoi.rows;
+      clear_cell_index (&area->aoi.agents, cells);
+      clear_cell_index (&area->aoi.objects, cells);
+      clear_cell_index (&area->aoi.shots, cells);
+    }
+
+  for (pass = 0; pass < 2; pass++)
+    {
+      for (area = areas; area; area = area->next)
+	{
+	  for (i = 0; i < area->agents.num; i++)
+	    {
+	      as = area->agents.agents [i];
+	      index_item (&area->aoi.agents, get_aoi_cell (area, as->place), as,
+			  pass);
+	    }
+	}
+
+      for (obj = objects; obj; obj = obj->next)
+	{
+	  index_item (&obj->area->aoi.objects, get_aoi_cell (obj->area,
+							     obj->place),
+		      obj, pass);
+	}
+
+      for (s = shots; s; s = s->next)
+	{
+	  if ((area = find_area (areas, s->areaid)))
+	    index_item (&area->aoi.shots, get_aoi_cell (area, s->target), s,
+			pass);
+	}
+
+      for (area = areas; !pass && area; area = area->next)
+	{
+	  cells = area->aoi.cols*area->aoi.rows;
+	  prepare_cell_index (&area->aoi.agents, cells);
+	  prepare_cell_index (&area->aoi.objects, cells);
+	  prepare_cell_index (&area->aoi.shots, cells);
+	}
+    }
+
+  for (area = areas; area; area = area->next)
+    cache_cell_visibles (area, timers);
+}
+
+
+/* called every tick.  Each player earns send_rate bytes of credit per
+   tick and gets a snapshot while the credit is positive, so a low rate
+   means fewer snapshots; but never fewer than one every MAX_SEND_INTERVAL
+   ticks */
+int
+should_send_snapshot (struct player *pl)
+{
+  pl->send_credit += pl->send_rate;
+
+  if (pl->send_credit > 2*pl->send_rate)
+    pl->send_credit = 2*pl->send_rate;
+
+  pl->ticks_since_snapshot++;
+
+  return pl->send_credit > 0 || pl->ticks_since_snapshot >= MAX_SEND_INTERVAL;
+}
+
+
+void
+record_snapshot (struct player *pl, uint32_t frame, size_t len)
+{
+  pl->send_credit -= len;
+  pl->ticks_since_snapshot = 0;
+  pl->last_snapshot_len = len;
+  pl->snapshots_sent++;
+  pl->sent_at [frame % SNAPSHOT_HISTORY] = pl->snapshots_sent;
+}
+
+
+/* the client acknowledged frame ack, after receiving received snapshots
+   in total.  Comparing that with how many we had sent up to ack tells how
+   many were lost */
+void
+sample_send_rate (struct player *pl, uint32_t ack, uint16_t received)
+{
+  if (pl->snapshots [ack % SNAPSHOT_HISTORY].frame != ack)
+    return;
+
+  pl->sample_sent = pl->sent_at [ack % SNAPSHOT_HISTORY];
+  pl->sample_received = received;
+}
+
+
+/* called every RATE_WINDOW ticks: additive increase of the send rate and
+   of the visible budget while losses stay under one in sixteen,
+   multiplicative decrease otherwise.  The visible budget only shrinks once
+   the rate is too low to send a snapshot every MAX_SEND_INTERVAL ticks */
+void
+update_send_rate (struct player *pl)
+{
+  int32_t sent, lost;
+
+  sent = pl->sample_sent - pl->window_sent;
+  lost = sent - (uint16_t) (pl->sample_received - pl->window_received);
+
+  if (!sent)
+    {
+      /* nothing acknowledged at all */
+      if (pl->snapshots_sent - pl->window_sent < MIN_RATE_SAMPLE)
+	return;
+
+      lost = sent = MIN_RATE_SAMPLE;
+    }
+  else if (sent < MIN_RATE_SAMPLE)
+    return;
+
+  if (lost*16 > sent)
+    {
+      pl->send_rate = pl->send_rate*3/4 < MIN_SEND_RATE
+	? MIN_SEND_RATE : pl->send_rate*3/4;
+
+      if ((size_t) pl->send_rate*MAX_SEND_INTERVAL < pl->last_snapshot_len)
+	pl->visible_budget = pl->visible_budget*3/4 < MIN_VISIBLE_BUDGET
+	  ? MIN_VISIBLE_BUDGET : pl->visible_budget*3/4;
+    }
+  else
+    {
+      pl->send_rate = pl->send_rate+SEND_RATE_STEP > MAX_SEND_RATE
+	? MAX_SEND_RATE : pl->send_rate+SEND_RATE_STEP;
+      pl->visible_budget = pl->visible_budget+VISIBLE_BUDGET_STEP
+	> MAX_VISIBLES ? MAX_VISIBLES
+	: pl->visible_budget+VISIBLE_BUDGET_STEP;
+    }
+
+  if (pl->sample_sent != pl->window_sent)
+    {
+      pl->window_sent = pl->sample_sent;
+      pl->window_received = pl->sample_received;
+    }
+}
+
+
+int
+compare_visible_ids (const void *v1, const void *v2)
+{
+  uint32_t id1 = ((const struct visible *) v1)->id,
+    id2 = ((const struct visible *) v2)->id;
+
+  return id1 < id2 ? -1 : id1 > id2;
+}
+
+
+/* what each snapshot worker writes to.  In ranks, id is an index into
+   candidates */
+struct
+snapshot_worker
+{
+  struct message msg;
+  struct visible *candidates;
+  int candidates_num;
+  int candidates_capacity;
+  struct priority *ranks;
+  unsigned char buf [MAX_PACKET_SIZE];
+  struct datagram_batch outbox;
+};
+
+
+/* the world as seen by the snapshot workers.  Nothing in it changes while
+   they run, except each player's own snapshot history */
+struct
+snapshot_job
+{
+  int sockfd;
+  uint32_t frame_counter;
+  const struct timer_wheel *timers;
+  int num_players;
+  int ids [MAX_PLAYERS];
+  struct snapshot_worker *workers;
+
+  struct player *players;
+};
+
+
+/* returns the next free candidate of w, cleared, making room for it if
+   needed */
+struct visible *
+add_visible (struct snapshot_worker *w)
+{
+  struct visible *vis;
+
+  if (w->candidates_num == w->candidates_capacity)
+    {
+      w->candidates_capacity = w->candidates_capacity
+	? w->candidates_capacity*2 : MAX_VISIBLES;
+      vis = malloc_and_check (sizeof (*vis) * w->candidates_capacity);
+
+      if (w->candidates_num)
+	memcpy (vis, w->candidates, sizeof (*vis) * w->candidates_num);
+
+      free (w->candidates);
+      w->candidates = vis;
+      free (w->ranks);
+      w->ranks = malloc_and_check (sizeof (*w->ranks)
+				   * w->candidates_capacity);
+    }
+
+  vis = &w->candidates [w->candidates_num++];
+  memset (vis, 0, sizeof (*vis));
+  return vis;
+}
+
+
+/* how much the priority of a visible grows each tick: more for the nearer
+   ones and for the kinds that change fastest.  The searchable icon belongs
+   to the player and always goes first */
+uint32_t
+visible_weight (const struct visible *vis, SDL_Rect charbox)
+{
+  int near = WINDOW_WIDTH+WINDOW_HEIGHT - abs ((int) vis->x - charbox.x)
+    - abs ((int) vis->y - charbox.y);
+
+  if (near < 1)
+    near = 1;
+
+  switch (vis->type)
+    {
+    case VISIBLE_SEARCHABLE:
+      return MAX_PRIORITY;
+    case VISIBLE_PLAYER:
+    case VISIBLE_ZOMBIE:
+    case VISIBLE_SHOT:
+      return 4*near;
+    case VISIBLE_SEARCHING:
+      return 2*near;
+    default:
+      return near;
+    }
+}
+
+
+int
+compare_priorities (const void *p1, const void *p2)
+{
+  const struct priority *pr1 = p1, *pr2 = p2;
+
+  if (pr1->value != pr2->value)
+    return pr1->value > pr2->value ? -1 : 1;
+
+  return pr1->id < pr2->id ? -1 : pr1->id > pr2->id;
+}
+
+
+int
+compare_priority_ids (const void *p1, const void *p2)
+{
+  uint32_t id1 = ((const struct priority *) p1)->id,
+    id2 = ((const struct priority *) p2)->id;
+
+  return id1 < id2 ? -1 : id1 > id2;
+}
+
+
+/* moves the candidates with the highest priority into st, sorted by id.
+   A candidate's priority is what it had in the last snapshot plus its
+   visible_weight, and goes back to zero when it is sent, so when there are
+   more candidates than budget the others still get their turn in later
+   snapshots.  Visibles that go out of sight lose their priority.  The
+   candidates left out that are in base go in st as they are there, so the
+   client keeps showing them instead of seeing them removed.  Without base
+   the client replaces everything it has, so the budget doesn't apply */
+void
+select_visibles (struct snapshot_worker *w, struct player *pl,
+		 SDL_Rect charbox, const struct snapshot *base,
+		 struct server_state_args *st)
+{
+  int n = w->candidates_num, limit = base ? pl->visible_budget : MAX_VISIBLES,
+    i, j, r;
+  uint32_t value, b;
+
+  if (limit > MAX_VISIBLES)
+    limit = MAX_VISIBLES;
+
+  if (n > 1)
+    qsort (w->candidates, n, sizeof (*w->candidates), compare_visible_ids);
+
+  for (i = 0, j = 0; i < n; i++)
+    {
+      while (j < pl->priorities_num
+	     && pl->priorities [j].id < w->candidates [i].id)
+	j++;
+
+      value = j < pl->priorities_num
+	&& pl->priorities [j].id == w->candidates [i].id
+	? pl->priorities [j].value : 0;
+      value += visible_weight (&w->candidates [i], charbox);
+
+      w->ranks [i].id = i;
+      w->ranks [i].value = value > MAX_PRIORITY ? MAX_PRIORITY : value;
+    }
+
+  if (n > limit)
+    {
+      qsort (w->ranks, n, sizeof (*w->ranks), compare_priorities);
+      qsort (w->ranks, limit, sizeof (*w->ranks), compare_priority_ids);
+    }
+  else
+    limit = n;
+
+  if (n > pl->priorities_capacity)
+    {
+      free (pl->priorities);
+      pl->priorities_capacity = n*2;
+      pl->priorities = malloc_and_check (sizeof (*pl->priorities)
+					 * pl->priorities_capacity);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      pl->priorities [i].id = w->candidates [i].id;
+      pl->priorities [i].value = 0;
+    }
+
+  for (i = limit; i < n; i++)
+    pl->priorities [w->ranks [i].id].value = w->ranks [i].value;
+
+  pl->priorities_num = n;
+  st->num_visibles = 0;
+
+  for (i = 0, b = 0, r = 0; i < n; i++)
+    {
+      if (r < limit && w->ranks [r].id == (uint32_t) i)
+	{
+	  st->visibles [st->num_visibles++] = w->candidates [i];
+	  r++;
+	  continue;
+	}
+
+      if (!base)
+	continue;
+
+      while (b < base->num_visibles
+	     && base->visibles [b].id < w->candidates [i].id)
+	b++;
+
+      if (b < base->num_visibles
+	  && base->visibles [b].id == w->candidates [i].id
+	  && st->num_visibles+limit-r < MAX_VISIBLES)
+	st->visibles [st->num_visibles++] = base->visibles [b];
+    }
 }
 
 
 void
-send_server_state (int sockfd, uint32_t frame_counter, int id, struct player *pls,
-		   struct agent *as, struct shot *ss, struct object *objs)
+encode_server_state (int sockfd, struct snapshot_worker *w,
+		     uint32_t frame_counter, const struct timer_wheel *timers,
+		     int id, struct player *pls)
 {
-  static struct message msg;
-  struct visible vis = {0};
+  struct message *m = &w->msg;
+  struct server_state_args *st = &m->args.server_state;
+  struct server_area *area = pls [id].agent->area;
+  struct aoi_grid *aoi = &area->aoi;
+  SDL_Rect charbox = pls [id].agent->place;
+  struct visible *vis;
+  struct snapshot *snap;
+  struct object *obj;
+  int cells [9], cells_num, c, k;
+  uint32_t acked;
+  size_t len;
   int i;
 
-  msg.type = htonl (MSG_SERVER_STATE);
-  msg.args.server_state.frame_counter = htonl (frame_counter);
-  msg.args.server_state.areaid = htonl (pls [id].agent->area->id);
-  msg.args.server_state.x = htonl (pls [id].agent->place.x);
-  msg.args.server_state.y = htonl (pls [id].agent->place.y);
-  msg.args.server_state.w = htonl (pls [id].agent->place.w);
-  msg.args.server_state.h = htonl (pls [id].agent->place.h);
-  msg.args.server_state.char_facing = pls [id].facing;
-  msg.args.server_state.life = htonl (pls [id].agent->life);
-  msg.args.server_state.is_immortal = !!pls [id].agent->immortal;
-  msg.args.server_state.bullets = htonl (pls [id].bullets);
-  msg.args.server_state.hunger = htonl (pls [id].hunger);
-  msg.args.server_state.thirst = htonl (pls [id].thirst);
-  msg.args.server_state.just_shot = pls [id].shoot_rest > 6;
-  msg.args.server_state.just_stabbed = pls [id].stab_rest > 2;
-  msg.args.server_state.is_searching = htonl (pls [id].is_searching);
+  m->type = MSG_SERVER_STATE;
+  st->frame_counter = frame_counter;
+  st->areaid = area->id;
+  st->x = charbox.x;
+  st->y = charbox.y;
+  st->w = charbox.w;
+  st->h = charbox.h;
+  st->char_facing = pls [id].facing;
+  st->life = pls [id].agent->life;
+  st->is_immortal = is_timer_pending (&pls [id].agent->immortal);
+  st->bullets = pls [id].bullets;
+  st->hunger = pls [id].hunger;
+  st->thirst = pls [id].thirst;
+  st->just_shot = get_timer_left (timers, &pls [id].shoot_rest) > 7;
+  st->just_stabbed = get_timer_left (timers, &pls [id].stab_rest) > 3;
+  st->is_searching = pls [id].is_searching;
 
   if (pls [id].is_searching)
     {
       for (i = 0; i < BAG_SIZE; i++)
 	{
-	  msg.args.server_state.bag [i] = htonl (pls [id].bag [i].type);
+	  st->bag [i] = pls [id].bag [i].type;
 	}
 
       if (pls [id].might_search_at
 	  && pls [id].might_search_at->searched_by == &pls [id])
 	{
-	  msg.args.server_state.is_searching
-	    = htonl (ntohl (msg.args.server_state.is_searching)+1);
+	  st->is_searching++;
 
 	  for (i = 0; i < BAG_SIZE; i++)
 	    {
-	      msg.args.server_state.bag [BAG_SIZE+i]
-		= htonl (pls [id].might_search_at->content [i].type);
+	      st->bag [BAG_SIZE+i] = pls [id].might_search_at->content [i].type;
 	    }
 	}
     }
 
-  msg.args.server_state.num_visibles = 0;
-  msg.args.server_state.npcid = htonl (pls [id].npcid);
-  msg.args.server_state.textbox_lines_num = htonl (pls [id].textbox_lines_num);
+  w->candidates_num = 0;
+  st->npcid = pls [id].npcid;
+  st->textbox_lines_num = pls [id].textbox_lines_num;
+
+  cells_num = get_aoi_cells (area, charbox, cells);
 
-  while (!pls [id].agent->area->is_private && as)
+  for (c = 0; c < cells_num; c++)
     {
-      if (msg.args.server_state.num_visibles == MAX_VISIBLES)
+      for (k = aoi->visibles_start [cells [c]];
+	   k < aoi->visibles_start [cells [c]+1]; k++)
 	{
-	  fprintf (stderr, "too many visibles to send to player %d, skipping some\n",
-		   id);
-	  goto send;
+	  if (aoi->visibles [k].id == pls [id].agent->id
+	      || !is_cached_visible_seen (charbox, &aoi->visibles [k]))
+	    continue;
+
+	  *add_visible (w) = aoi->visibles [k];
 	}
+    }
 
-      if ((as->type != AGENT_PLAYER || as->data_ptr.player != &pls [id])
-	  && as->area == pls [id].agent->area
-	  && is_visible_by_player (pls [id].agent->place, as->place))
+  if (area->is_private)
+    {
+      for (obj = pls [id].agent->private_area->objects; obj; obj = obj->next)
 	{
-	  vis.type = htonl (as->type == AGENT_PLAYER ? VISIBLE_PLAYER
-			    : VISIBLE_ZOMBIE);
-	  vis.subtype = as->type == AGENT_PLAYER
-	    ? htonl (as->data_ptr.player->bodytype) :
-	    as->type == AGENT_ZOMBIE ? htonl (as->data_ptr.zombie->type) : 0;
-	  vis.x = htonl (as->place.x);
-	  vis.y = htonl (as->place.y);
-	  vis.w = htonl (as->place.w);
-	  vis.h = htonl (as->place.h);
-
-	  if (as->type == AGENT_PLAYER)
-	    {
-	      vis.facing = htonl (as->data_ptr.player->facing);
-	      vis.speed_x = htonl (as->data_ptr.player->speed_x);
-	      vis.speed_y = htonl (as->data_ptr.player->speed_y);
-	    }
-	  else
-	    {
-	      vis.facing = htonl (as->data_ptr.zombie->facing);
-	      vis.speed_x = htonl (as->data_ptr.zombie->speed_x);
-	      vis.speed_y = htonl (as->data_ptr.zombie->speed_y);
-	      vis.is_immortal = !!as->immortal;
-	    }
+	  if (obj->area != area || !is_visible_by_player (charbox, obj->place))
+	    continue;
 
-	  memcpy (&msg.args.server_state.visibles
-		  [msg.args.server_state.num_visibles], &vis, sizeof (vis));
-	  msg.args.server_state.num_visibles++;
+	  if (!make_object_visible (add_visible (w), obj))
+	    w->candidates_num--;
 	}
-
-      as = as->next;
     }
 
-  for (i = 0; i < MAX_PLAYERS; i++)
+  if (!pls [id].is_searching && pls [id].might_search_at
+      && !pls [id].might_search_at->searched_by)
     {
-      if (pls [i].id != -1 && !pls [id].agent->area->is_private
-	  && pls [id].agent->area == pls [i].agent->area
-	  && pls [i].is_searching && pls [i].might_search_at
-	  && pls [i].might_search_at->searched_by == &pls [i])
-	{
-	  if (msg.args.server_state.num_visibles == MAX_VISIBLES)
-	    {
-	      fprintf (stderr, "too many visibles to send to player %d, skipping some\n",
-		       id);
-	      goto send;
-	    }
+      vis = add_visible (w);
+      vis->id = VISIBLE_ID_SEARCHABLE;
+      vis->type = VISIBLE_SEARCHABLE;
+      vis->x = pls [id].might_search_at->icon.x;
+      vis->y = pls [id].might_search_at->icon.y;
+      vis->w = pls [id].might_search_at->icon.w;
+      vis->h = pls [id].might_search_at->icon.h;
+    }
 
-	  vis.type = htonl (VISIBLE_SEARCHING);
-	  vis.x = htonl (pls [i].agent->place.x+12);
-	  vis.y = htonl (pls [i].agent->place.y-16);
-	  vis.w = htonl (16);
-	  vis.h = htonl (16);
+  if (pls [id].textbox)
+    {
+      strcpy (st->textbox, pls [id].textbox);
+    }
+  else
+    st->textbox_lines_num = 0;
 
-	  memcpy (&msg.args.server_state.visibles
-		  [msg.args.server_state.num_visibles], &vis, sizeof (vis));
-	  msg.args.server_state.num_visibles++;
-	}
+  for (i = 0, k = 0; i < w->candidates_num; i++)
+    {
+      if (does_visible_fit (&w->candidates [i]))
+	w->candidates [k++] = w->candidates [i];
+      else
+	fprintf (stderr, "visible %u does not fit in a snapshot, leaving it "
+		 "out\n", w->candidates [i].id);
     }
 
-  if (pls [id].agent->area->is_private)
-    objs = pls [id].agent->private_area->objects;
+  w->candidates_num = k;
+
+  acked = pls [id].acked_frame;
+  st->baseline =
+    acked && frame_counter-acked < SNAPSHOT_HISTORY
+    && pls [id].snapshots [acked % SNAPSHOT_HISTORY].frame == acked ? acked : 0;
 
-  while (objs)
+  select_visibles (w, &pls [id], charbox,
+		   st->baseline
+		   ? &pls [id].snapshots [acked % SNAPSHOT_HISTORY] : NULL, st);
+
+  len = encode_message (m, pls [id].snapshots, w->buf, sizeof (w->buf));
+
+  if (!len)
     {
-      if (msg.args.server_state.num_visibles == MAX_VISIBLES)
-	{
-	  fprintf (stderr, "too many visibles to send to player %d, skipping some\n",
-		   id);
-	  goto send;
-	}
+      fprintf (stderr, "could not encode state for player %d, skipping "
+	       "this snapshot\n", id);
+      return;
+    }
 
-      if (objs->area == pls [id].agent->area
-	  && is_visible_by_player (pls [id].agent->place, objs->place))
-	{
-	  switch (objs->type)
-	    {
-	    case OBJECT_HEALTH:
-	      vis.type = htonl (VISIBLE_HEALTH);
-	      break;
-	    case OBJECT_AMMO:
-	      vis.type = htonl (VISIBLE_AMMO);
-	      break;
-	    case OBJECT_FOOD:
-	      vis.type = htonl (VISIBLE_FOOD);
-	      break;
-	    case OBJECT_WATER:
-	      vis.type = htonl (VISIBLE_WATER);
-	      break;
-	    case OBJECT_FLESH:
-	      vis.type = htonl (VISIBLE_FLESH);
-	      break;
-	    default:
-	      continue;
-	    }
+  queue_encoded_message (sockfd, &w->outbox, &pls [id].address, w->buf, len,
+			 frame_counter);
+  record_snapshot (&pls [id], frame_counter, len);
 
-	  vis.x = htonl (objs->place.x);
-	  vis.y = htonl (objs->place.y);
-	  vis.w = htonl (objs->place.w);
-	  vis.h = htonl (objs->place.h);
+  snap = &pls [id].snapshots [frame_counter % SNAPSHOT_HISTORY];
+  snap->frame = frame_counter;
+  snap->num_visibles = st->num_visibles;
+  memcpy (snap->visibles, st->visibles,
+	  sizeof (struct visible) * snap->num_visibles);
+}
 
-	  memcpy (&msg.args.server_state.visibles
-		  [msg.args.server_state.num_visibles], &vis, sizeof (vis));
-	  msg.args.server_state.num_visibles++;
-	}
 
-      objs = objs->next;
-    }
+void
+encode_server_state_job (int job, int worker, void *arg)
+{
+  struct snapshot_job *sj = arg;
 
-  while (ss)
-    {
-      if (msg.args.server_state.num_visibles == MAX_VISIBLES)
-	{
-	  fprintf (stderr, "too many visibles to send to player %d, skipping some\n",
-		   id);
-	  goto send;
-	}
+  encode_server_state (sj->sockfd, &sj->workers [worker], sj->frame_counter,
+		       sj->timers, sj->ids [job], sj->players);
+}
 
-      if (ss->areaid == pls [id].agent->area->id
-	  && is_visible_by_player (pls [id].agent->place, ss->target))
-	{
-	  vis.type = htonl (VISIBLE_SHOT);
-	  vis.duration = htonl (ss->duration);
-	  vis.x = htonl (ss->target.x);
-	  vis.y = htonl (ss->target.y);
-	  vis.w = htonl (ss->target.w);
-	  vis.h = htonl (ss->target.h);
-	  memcpy (&msg.args.server_state.visibles
-		  [msg.args.server_state.num_visibles], &vis, sizeof (vis));
-	  msg.args.server_state.num_visibles++;
-	}
 
-      ss = ss->next;
-    }
+/* returns the player that sent a message from addr, or -1.  A message
+   from an unknown address is still accepted if it carries the right token,
+   as happens when a NAT gives the client a new port */
+int
+find_player (struct session_table *sessions, struct player pls [],
+	     struct sockaddr_in *addr, uint32_t id, uint32_t token)
+{
+  int ret = find_session (sessions, addr);
 
-  if (!pls [id].is_searching && pls [id].might_search_at
-      && !pls [id].might_search_at->searched_by)
-    {
-      vis.type = htonl (VISIBLE_SEARCHABLE);
-      vis.x = htonl (pls [id].might_search_at->icon.x);
-      vis.y = htonl (pls [id].might_search_at->icon.y);
-      vis.w = htonl (pls [id].might_search_at->icon.w);
-      vis.h = htonl (pls [id].might_search_at->icon.h);
-      memcpy (&msg.args.server_state.visibles
-	      [msg.args.server_state.num_visibles], &vis, sizeof (vis));
-      msg.args.server_state.num_visibles++;
-    }
+  if (ret != -1)
+    return pls [ret].token == token ? ret : -1;
 
- send:
-  msg.args.server_state.num_visibles = htonl (msg.args.server_state.num_visibles);
+  if (id >= MAX_PLAYERS || pls [id].id == -1 || pls [id].token != token)
+    return -1;
 
-  if (pls [id].textbox)
-    {
-      strcpy (msg.args.server_state.textbox, pls [id].textbox);
-    }
-  else
-    msg.args.server_state.textbox_lines_num = 0;
+  remove_session (sessions, &pls [id].address, id);
+  pls [id].address = *addr;
+  add_session (sessions, addr, id);
 
-  if (sendto (sockfd, &msg, offsetof (struct message, args)
-	      + offsetof (struct server_state_args, visibles)
-	      + sizeof (struct visible) * ntohl (msg.args.server_state.num_visibles),
-	      0, (struct sockaddr *)&pls [id].address, sizeof (pls [id].address)) < 0)
-    {
-      fprintf (stderr, "could not send data\n");
-      exit (1);
-    }
+  return id;
 }
 
 
@@ -1379,6 +3413,10 @@ print_help_and_exit (void)
   printf ("Usage: zombielandd [OPTIONS]\n"
 	  "Options:\n"
 	  "\t-g, --display-gui     display a basic GUI\n"
+	  "\t-j, --workers N       build snapshots on N threads (default: one\n"
+	  "\t                      per processor)\n"
+	  "\t-s, --seed N          seed the simulation with N (default: the\n"
+	  "\t                      current time)\n"
 	  "\t-h, --help            display this help and exit\n");
   exit (0);
 }
@@ -1400,21 +3438,27 @@ print_welcome_message (void)
 int
 main (int argc, char *argv[])
 {
-  struct agent *agents = NULL, *shotag, *stabbed;
-  struct player players [MAX_PLAYERS];
-  struct zombie *z, *prz;
+  struct agent *shotag, *stabbed;
+  struct player players [MAX_PLAYERS], *pl;
+  struct zombie *z, *prz, *warped = NULL;
   struct shot *shots = NULL, *s, *prs;
   struct object *objects = NULL, *obj, *probj;
 
   int sockfd;
-  fd_set fdset;
-  struct timeval timeout = {0};
-  struct message buffer;
-  ssize_t recvlen;
+  struct worker_pool pool;
+  struct snapshot_job snapjob;
+  struct command_queue commands;
+  struct session_table sessions;
+  struct ingest_thread ingest;
+  struct command cmd;
+  struct event_loop loop;
+  struct timespec next_tick, now;
+  struct timer_wheel timers;
+  struct timer zombie_spawn, object_spawn, *t;
+  struct prng tokens;
   struct sockaddr_in local_addr, client_addr;
-  socklen_t client_addr_sz = sizeof (client_addr);
 
-  struct message *msg;
+  struct message reply;
 
   struct interactible *in;
   struct warp *w;
@@ -1557,9 +3601,9 @@ main (int argc, char *argv[])
   struct private_server_area *par;
 
   SDL_Window *win;
-  SDL_Renderer *rend;
+  SDL_Renderer *rend = NULL;
   SDL_Surface *iconsurf;
-  TTF_Font *hudfont;
+  TTF_Font *hudfont = NULL;
   SDL_Color textcol = {0, 0, 0, 255};
   SDL_Rect screen = {0, 0, WINDOW_WIDTH, WINDOW_HEIGHT};
   SDL_Event event;
@@ -1567,15 +3611,52 @@ main (int argc, char *argv[])
 
   uint32_t frame_counter = 1, id;
   int char_hit, hit, quit = 0, i, j, display_gui = 0, last_refresh = 1, speedx,
-    speedy, dist, zombie_spawn_counter = 0, object_spawn_counter = 0;
-  Uint32 t1, t2;
-  double delay;
+    speedy, num_workers = default_num_workers ();
+  unsigned long long seed = time (NULL);
+  char *endptr;
+  Uint32 t1;
 
 
   for (i = 1; i < argc; i++)
     {
       if (!strcmp (argv [i], "--display-gui") || !strcmp (argv [i], "-g"))
 	display_gui = 1;
+      else if (!strcmp (argv [i], "--workers") || !strcmp (argv [i], "-j"))
+	{
+	  if (i+1 == argc)
+	    {
+	      fprintf (stderr, "option '%s' needs an argument\n", argv [i]);
+	      print_help_and_exit ();
+	    }
+
+	  i++;
+	  num_workers = strtol (argv [i], &endptr, 10);
+
+	  if (*endptr || num_workers < 1 || num_workers > MAX_WORKERS)
+	    {
+	      fprintf (stderr, "number of workers must be between 1 and %d\n",
+		       MAX_WORKERS);
+	      print_help_and_exit ();
+	    }
+	}
+      else if (!strcmp (argv [i], "--seed") || !strcmp (argv [i], "-s"))
+	{
+	  if (i+1 == argc)
+	    {
+	      fprintf (stderr, "option '%s' needs an argument\n", argv [i]);
+	      print_help_and_exit ();
+	    }
+
+	  i++;
+	  errno = 0;
+	  seed = strtoull (argv [i], &endptr, 10);
+
+	  if (!isdigit (*argv [i]) || *endptr || errno)
+	    {
+	      fprintf (stderr, "seed must be a nonnegative integer\n");
+	      print_help_and_exit ();
+	    }
+	}
       else if (!strcmp (argv [i], "--help") || !strcmp (argv [i], "-h"))
 	print_help_and_exit ();
       else
@@ -1620,6 +3701,18 @@ main (int argc, char *argv[])
     }
 
   printf ("listening on port %d...\n", ZOMBIELAND_PORT);
+  printf ("using %s collision kernel\n", select_rect_kernel ());
+
+  init_worker_pool (&pool, num_workers);
+  snapjob.sockfd = sockfd;
+  snapjob.workers = calloc_and_check (num_workers, sizeof (*snapjob.workers));
+
+  for (i = 0; i < num_workers; i++)
+    init_datagram_batch (&snapjob.workers [i].outbox, OUTBOX_SIZE);
+  init_command_queue (&commands, COMMAND_QUEUE_SIZE);
+  init_session_table (&sessions);
+  init_event_loop (&loop, commands.wakefd [0]);
+  start_ingest_thread (&ingest, sockfd, &commands);
 
   field.id = 0;
   field.walkable = field_walkable;
@@ -1699,7 +3792,34 @@ main (int argc, char *argv[])
   hotel_room.object_spawns_num = hotel_room.free_object_spawns_num = 1;
   hotel_room.bags = &hotel_room_bag;
 
-  srand (time (NULL));
+  for (area = &field; area; area = area->next)
+    {
+      init_aoi_grid (area);
+      init_agent_set (&area->agents, area->walkable);
+      init_obstacle_index (&area->full_index, area->full_obstacles,
+			   area->full_obstacles_num, area->walkable);
+      init_obstacle_index (&area->half_index, area->half_obstacles,
+			   area->half_obstacles_num, area->walkable);
+      init_flow_field (area);
+      init_player_index (area);
+      seed_prng (&area->prng, seed, area->id);
+    }
+
+  init_warp_routes (&field);
+
+  init_timer_wheel (&timers, frame_counter);
+  init_timer (&zombie_spawn, TIMER_PASSIVE, NULL);
+  start_timer (&timers, &zombie_spawn, ZOMBIE_SPAWN_INTERVAL);
+  init_timer (&object_spawn, TIMER_PASSIVE, NULL);
+  start_timer (&timers, &object_spawn, OBJECT_SPAWN_INTERVAL);
+
+  printf ("using seed %llu\n", seed);
+
+  if (!seed_prng_from_system (&tokens))
+    {
+      fprintf (stderr, "could not read /dev/urandom to make session tokens\n");
+      return 1;
+    }
 
 
   if (display_gui)
@@ -1749,9 +3869,10 @@ main (int argc, char *argv[])
     }
 
 
+  get_monotonic_time (&next_tick);
+
   while (!quit)
     {
-      t1 = SDL_GetTicks ();
 
       while (SDL_PollEvent (&event))
 	{
@@ -1770,147 +3891,126 @@ main (int argc, char *argv[])
       while (1)
 	{
 	get_new_message:
-	  FD_ZERO (&fdset);
-	  FD_SET (sockfd, &fdset);
-
-	  if (select (sockfd+1, &fdset, NULL, NULL, &timeout) < 0)
-	    {
-	      fprintf (stderr, "could not poll socket\n");
-	      return 1;
-	    }
-
-	  if (!FD_ISSET (sockfd, &fdset))
-	    break;
-
-	  recvlen =
-	    recvfrom (sockfd, &buffer, sizeof (buffer), 0,
-		      (struct sockaddr *) &client_addr, &client_addr_sz);
-
-	  if (recvlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
-	    break;
-
-	  if (recvlen < 0)
-	    {
-	      fprintf (stderr, "could not receive data from the client\n");
-	      return 1;
-	    }
-
-	  if (recvlen < 5)
+	  if (!pop_command (&commands, &cmd))
 	    {
-	      fprintf (stderr, "got a message too short from client\n");
-	      return 1;
-	    }
+	      if (wait_for_input (&loop, &next_tick))
+		goto get_new_message;
 
-	  if (recvlen > sizeof (*msg))
-	    {
-	      fprintf (stderr, "got a message too long from client\n");
-	      return 1;
+	      break;
 	    }
 
-	  msg = (struct message *) &buffer;
-	  msg->type = ntohl (msg->type);
+	  client_addr = cmd.addr;
 
-	  switch (msg->type)
+	  switch (cmd.type)
 	    {
 	    case MSG_LOGIN:
-	      msg->args.login.logname [MAX_LOGNAME_LEN] = 0;
+	      id = find_session (&sessions, &client_addr);
+
+	      if (id != -1 && !strcmp (players [id].name,
+				       cmd.args.login.logname))
+		{
+		  /* our answer got lost, send it again */
+		  reply.type = MSG_LOGINOK;
+		  reply.args.loginok.id = id;
+		  reply.args.loginok.token = players [id].token;
+		  send_message (sockfd, &client_addr, &reply);
+		  break;
+		}
 
 	      for (i = 0; i < MAX_PLAYERS; i++)
 		{
 		  if (players [i].id != -1
-		      && !strcmp (players [i].name, msg->args.login.logname))
+		      && !strcmp (players [i].name, cmd.args.login.logname))
 		    {
 		      fprintf (stderr, "username %s already log in\n",
-			       msg->args.login.logname);
-		      send_message (sockfd, &client_addr,
-				    ntohs (msg->args.login.portoff),
-				    MSG_LOGNAME_IN_USE);
+			       cmd.args.login.logname);
+		      reply.type = MSG_LOGNAME_IN_USE;
+		      send_message (sockfd, &client_addr, &reply);
 		      goto get_new_message;
 		    }
 		}
 
-	      msg->args.login.bodytype = ntohl (msg->args.login.bodytype);
-
-	      if (msg->args.login.bodytype < 0 || msg->args.login.bodytype > 6)
-		msg->args.login.bodytype = 0;
+	      if (cmd.args.login.bodytype > 6)
+		cmd.args.login.bodytype = 0;
 
-	      id = create_player (msg->args.login.logname,
-				  msg->args.login.bodytype, &client_addr,
-				  ntohs (msg->args.login.portoff), &hotel_room,
-				  &field, players, &agents);
+	      id = create_player (cmd.args.login.logname,
+				  cmd.args.login.bodytype, &client_addr,
+				  &hotel_room, &field, players, &timers,
+				  &tokens);
 
 	      if (id == -1)
 		{
 		  fprintf (stderr,
 			   "client tried login but there are too many players\n");
-		  send_message (sockfd, &client_addr,
-				ntohs (msg->args.login.portoff), MSG_SERVER_FULL);
+		  reply.type = MSG_SERVER_FULL;
+		  send_message (sockfd, &client_addr, &reply);
 		  break;
 		}
 
-	      printf ("created player %s with port offset %d\n",
-		      msg->args.login.logname, players [id].portoffset);
-
-	      msg->type = htonl (MSG_LOGINOK);
-	      msg->args.loginok.id = htonl (id);
-
-	      client_addr.sin_port = htons (ZOMBIELAND_PORT
-					    +players [id].portoffset);
+	      printf ("created player %s at %s:%d\n", cmd.args.login.logname,
+		      inet_ntoa (client_addr.sin_addr),
+		      ntohs (client_addr.sin_port));
+	      add_session (&sessions, &client_addr, id);
 
-	      if (sendto (sockfd, (char *)msg, sizeof (*msg), 0,
-			  (struct sockaddr *) &client_addr, client_addr_sz) < 0)
-		{
-		  fprintf (stderr, "could not send data\n");
-		  return 1;
-		}
+	      reply.type = MSG_LOGINOK;
+	      reply.args.loginok.id = id;
+	      reply.args.loginok.token = players [id].token;
+	      send_message (sockfd, &players [id].address, &reply);
 	      break;
 	    case MSG_CLIENT_CHAR_STATE:
-	      id = ntohl (msg->args.client_char_state.id);
+	      id = find_player (&sessions, players, &client_addr,
+				cmd.args.client_char_state.id,
+				cmd.args.client_char_state.token);
 
-	      if (players [id].id == -1)
+	      if (id == -1)
 		{
-		  fprintf (stderr, "got state from unknown id %d\n", id);
+		  fprintf (stderr, "got state from unknown client %s:%d\n",
+			   inet_ntoa (client_addr.sin_addr),
+			   ntohs (client_addr.sin_port));
 		}
 	      else if (players [id].last_update
-		       < ntohl (msg->args.client_char_state.frame_counter))
+		       < cmd.args.client_char_state.frame_counter)
 		{
-		  if (!players [id].freeze)
+		  if (!is_timer_pending (&players [id].freeze))
 		    {
 		      if (!players [id].is_searching)
 			{
 			  players [id].speed_x =
-			    (int32_t) ntohl (msg->args.client_char_state.char_speed_x) > 0
+			    cmd.args.client_char_state.char_speed_x > 0
 			    ? CHAR_SPEED
-			    : (int32_t) ntohl (msg->args.client_char_state.char_speed_x) < 0
+			    : cmd.args.client_char_state.char_speed_x < 0
 			    ? -CHAR_SPEED : 0;
 			  players [id].speed_y =
-			    (int32_t) ntohl (msg->args.client_char_state.char_speed_y) > 0
+			    cmd.args.client_char_state.char_speed_y > 0
 			    ? CHAR_SPEED
-			    : (int32_t) ntohl (msg->args.client_char_state.char_speed_y) < 0
+			    : cmd.args.client_char_state.char_speed_y < 0
 			    ? -CHAR_SPEED : 0;
 			  players [id].facing
-			    = ntohl (msg->args.client_char_state.char_facing);
+			    = cmd.args.client_char_state.char_facing;
 			}
 
 		      players [id].interact
-			= msg->args.client_char_state.do_interact;
+			= cmd.args.client_char_state.do_interact;
 
-		      if (msg->args.client_char_state.do_shoot
+		      if (cmd.args.client_char_state.do_shoot
 			  && !players [id].agent->area->is_peaceful
 			  && !players [id].interact && players [id].bullets
-			  && !players [id].shoot_rest)
+			  && !is_timer_pending (&players [id].shoot_rest))
 			{
-			  players [id].shoot_rest = SHOOT_REST;
+			  start_timer (&timers, &players [id].shoot_rest,
+				       SHOOT_REST);
 			}
 
-		      if (msg->args.client_char_state.do_stab
+		      if (cmd.args.client_char_state.do_stab
 			  && !players [id].agent->area->is_peaceful
-			  && !players [id].interact && !players [id].stab_rest)
+			  && !players [id].interact
+			  && !is_timer_pending (&players [id].stab_rest))
 			{
-			  players [id].stab_rest = STAB_REST;
+			  start_timer (&timers, &players [id].stab_rest,
+				       STAB_REST);
 			}
 
-		      if (msg->args.client_char_state.do_search
+		      if (cmd.args.client_char_state.do_search
 			  && !players [id].interact)
 			{
 			  if (!players [id].is_searching)
@@ -1934,23 +4034,40 @@ main (int argc, char *argv[])
 			  players [id].is_searching = 0;
 			}
 
-		      players [id].swap1 =
-			(int32_t) ntohl (msg->args.client_char_state.swap [0]);
-		      players [id].swap2 =
-			(int32_t) ntohl (msg->args.client_char_state.swap [1]);
+		      players [id].swap1 = cmd.args.client_char_state.swap [0];
+		      players [id].swap2 = cmd.args.client_char_state.swap [1];
+		    }
+
+		  if (cmd.args.client_char_state.ack_frame < frame_counter
+		      && cmd.args.client_char_state.ack_frame
+		      > players [id].acked_frame)
+		    {
+		      players [id].acked_frame
+			= cmd.args.client_char_state.ack_frame;
+		      sample_send_rate (&players [id],
+					cmd.args.client_char_state.ack_frame,
+					cmd.args.client_char_state.received);
 		    }
 
 		  players [id].last_update
-		    = ntohl (msg->args.client_char_state.frame_counter);
-		  players [id].timeout = CLIENT_TIMEOUT;
+		    = cmd.args.client_char_state.frame_counter;
+		  start_timer (&timers, &players [id].timeout, CLIENT_TIMEOUT);
 		}
 	      break;
-	    default:
-	      fprintf (stderr, "message type not known (%d)\n", msg->type);
-	      return 1;
 	    }
 	}
 
+      get_monotonic_time (&now);
+
+      if (nanoseconds_between (&next_tick, &now) >= FRAME_DURATION_NS)
+	{
+	  printf ("warning: frame skipped\n");
+	  next_tick = now;
+	}
+
+      add_nanoseconds (&next_tick, FRAME_DURATION_NS);
+      t1 = SDL_GetTicks ();
+
 
       area = &field;
 
@@ -1958,82 +4075,54 @@ main (int argc, char *argv[])
 	{
 	  z = area->zombies;
 
+	  if (z)
+	    {
+	      update_flow_field (area, players);
+	      index_players (area, players);
+	      target_nearest_players (area, players);
+	    }
+
 	  while (z)
 	    {
-	      if (!z->freeze)
+	      if (!is_timer_pending (&z->freeze))
 		{
-		  if (!z->next_thinking)
+		  if (!is_timer_pending (&z->next_thinking))
 		    {
-		      if (z->type == ZOMBIE_WALKER)
-			id = compute_nearest_player (z, players, &dist);
-
-		      if (z->type == ZOMBIE_WALKER && id != -1
-			  && dist < ZOMBIE_SIGHT)
-			{
-			  if (z->agent->place.x != players [id].agent->place.x)
-			    {
-			      z->speed_x = ZOMBIE_WALKER_SPEED
-				* (z->agent->place.x > players [id].agent->place.x
-				   ? -1 : 1);
-			      z->facing = z->speed_x > 0 ? FACING_RIGHT : FACING_LEFT;
-			    }
-			  else
-			    z->speed_x = 0;
-
-			  if (z->agent->place.y != players [id].agent->place.y)
-			    {
-			      z->speed_y = ZOMBIE_WALKER_SPEED
-				* (z->agent->place.y > players [id].agent->place.y
-				   ? -1 : 1);
-			      z->facing = z->speed_y > 0 ? FACING_DOWN : FACING_UP;
-			    }
-			  else
-			    z->speed_y = 0;
-			}
+		      if (z->target != -1)
+			chase_target (z, players);
 		      else
 			{
-			  z->speed_x = (rand () % 3 - 1)*
+			  z->speed_x = (get_random_below (&area->prng, 3) - 1)*
 			    (z->type == ZOMBIE_WALKER ? ZOMBIE_WALKER_SPEED
 			     : ZOMBIE_BLOB_SPEED);
 			  z->facing = z->speed_x > 0 ? FACING_RIGHT
 			    : z->speed_x < 0 ? FACING_LEFT : z->facing;
 
-			  z->speed_y = (rand () % 3 - 1)*
+			  z->speed_y = (get_random_below (&area->prng, 3) - 1)*
 			    (z->type == ZOMBIE_WALKER ? ZOMBIE_WALKER_SPEED
 			     : ZOMBIE_BLOB_SPEED);
 			  z->facing = z->speed_y > 0 ? FACING_DOWN
 			    : z->speed_y < 0 ? FACING_UP : z->facing;
 			}
 
-		      z->next_thinking = z->type == ZOMBIE_WALKER
-			? ZOMBIE_WALKER_THINKING_INTERVAL
-			: ZOMBIE_BLOB_THINKING_INTERVAL;
-		    }
-		  else
-		    z->next_thinking--;
-		}
-	      else
-		{
-		  z->freeze--;
-
-		  if (!z->freeze)
-		    {
-		      z->speed_x = z->speed_y = 0;
+		      start_timer (&timers, &z->next_thinking,
+				   z->type == ZOMBIE_WALKER
+				   ? ZOMBIE_WALKER_THINKING_INTERVAL
+				   : ZOMBIE_BLOB_THINKING_INTERVAL);
 		    }
+		  else if (z->target != -1)
+		    chase_target (z, players);
 		}
 
-	      if (z->agent->immortal)
-		z->agent->immortal--;
-
 	      z = z->next;
 	    }
 
 	  area = area->next;
 	}
 
-      if (zombie_spawn_counter == ZOMBIE_SPAWN_INTERVAL)
+      if (!is_timer_pending (&zombie_spawn))
 	{
-	  zombie_spawn_counter = 0;
+	  start_timer (&timers, &zombie_spawn, ZOMBIE_SPAWN_INTERVAL);
 
 	  area = &field;
 
@@ -2041,13 +4130,13 @@ main (int argc, char *argv[])
 	    {
 	      if (area->zombie_spawns_num && area->zombies_num < MAX_ZOMBIES)
 		{
-		  i = rand () % area->zombie_spawns_num;
-		  area->zombies = make_zombie (rand () % 10 < 8 ? ZOMBIE_WALKER
+		  i = get_random_below (&area->prng, area->zombie_spawns_num);
+		  j = get_random_below (&area->prng, 10);
+		  area->zombies = make_zombie (j < 8 ? ZOMBIE_WALKER
 					       : ZOMBIE_BLOB,
 					       area->zombie_spawns [i].x,
 					       area->zombie_spawns [i].y,
-					       FACING_DOWN, area, area->zombies,
-					       &agents);
+					       FACING_DOWN, area, area->zombies);
 		  area->zombies_num++;
 		}
 
@@ -2055,9 +4144,9 @@ main (int argc, char *argv[])
 	    }
 	}
 
-      if (object_spawn_counter == OBJECT_SPAWN_INTERVAL)
+      if (!is_timer_pending (&object_spawn))
 	{
-	  object_spawn_counter = 0;
+	  start_timer (&timers, &object_spawn, OBJECT_SPAWN_INTERVAL);
 
 	  area = &field;
 
@@ -2070,9 +4159,10 @@ main (int argc, char *argv[])
 		      if (!area->object_spawns [i].content)
 			{
 			  obj = malloc_and_check (sizeof (*obj));
+			  obj->id = new_entity_id ();
 			  obj->area = area;
 			  obj->place = area->object_spawns [i].place;
-			  obj->type = rand () % 4 + 1;
+			  obj->type = get_random_below (&area->prng, 4) + 1;
 			  obj->spawn = &area->object_spawns [i];
 			  obj->next = objects;
 			  area->object_spawns [i].content = obj;
@@ -2101,9 +4191,11 @@ main (int argc, char *argv[])
 			  if (!par->object_spawns [j].content)
 			    {
 			      obj = malloc_and_check (sizeof (*obj));
+			      obj->id = new_entity_id ();
 			      obj->area = par->area;
 			      obj->place = par->object_spawns [j].place;
-			      obj->type = rand () % 4 + 1;
+			      obj->type =
+				get_random_below (&par->area->prng, 4) + 1;
 			      obj->spawn = &par->object_spawns [j];
 			      obj->next = par->objects;
 			      par->object_spawns [j].content = obj;
@@ -2123,13 +4215,13 @@ main (int argc, char *argv[])
 	  if (players [i].id == -1)
 	    continue;
 
-	  players [i].agent->place =
-	    move_character (&players [i], players [i].agent->area->walkable,
-			    players [i].agent->area->full_obstacles,
-			    players [i].agent->area->full_obstacles_num,
-			    players [i].agent->area->half_obstacles,
-			    players [i].agent->area->half_obstacles_num,
-			    players [i].agent->area->zombies, &char_hit);
+	  move_agent (players [i].agent,
+		      move_character (&players [i],
+				      players [i].agent->area->walkable,
+				      &players [i].agent->area->full_index,
+				      &players [i].agent->area->half_index,
+				      &get_agent_set (players [i].agent)->grid,
+				      &timers, &char_hit));
 
 	  if (players [i].interact)
 	    {
@@ -2168,106 +4260,74 @@ main (int argc, char *argv[])
 	      players [i].interact = 0;
 	    }
 
-	  if (players [i].shoot_rest == SHOOT_REST)
+	  if (get_timer_left (&timers, &players [i].shoot_rest) == SHOOT_REST)
 	    {
 	      hitrect = get_shot_rect (players [i].agent->place, players [i].facing,
-				       players [i].agent->area, agents, &hit,
-				       &shotag);
+				       players [i].agent->area,
+				       &get_agent_set (players [i].agent)->grid,
+				       &hit, &shotag);
 
 	      if (hit)
 		{
 		  s = malloc_and_check (sizeof (*s));
+		  s->id = new_entity_id ();
 		  s->areaid = players [i].agent->area->id;
 		  s->target = hitrect;
-		  s->duration = 10;
+		  init_timer (&s->duration, TIMER_SHOT, s);
+		  start_timer (&timers, &s->duration, 10);
 		  s->next = shots;
 		  shots = s;
 		}
 
 	      players [i].bullets--;
 
-	      if (shotag && !shotag->immortal)
+	      if (shotag && !is_timer_pending (&shotag->immortal))
 		{
-		  shotag->immortal = IMMORTAL_DURATION;
+		  start_timer (&timers, &shotag->immortal, IMMORTAL_DURATION);
 		  shotag->life -= SHOOT_DAMAGE;
 
 		  if (shotag->type == AGENT_ZOMBIE
-		      && !shotag->data_ptr.zombie->freeze)
-		    shotag->data_ptr.zombie->freeze = 2;
+		      && !is_timer_pending (&shotag->data_ptr.zombie->freeze))
+		    start_timer (&timers, &shotag->data_ptr.zombie->freeze, 2);
 		}
 	    }
 
-	  if (players [i].stab_rest == STAB_REST)
+	  if (get_timer_left (&timers, &players [i].stab_rest) == STAB_REST)
 	    {
 	      stabbed = get_stabbed_agent (players [i].agent->place,
 					   players [i].facing,
-					   players [i].agent->area, agents,
+					   &get_agent_set (players [i].agent)->grid,
 					   &speedx, &speedy);
 
-	      if (stabbed && !stabbed->immortal)
+	      if (stabbed && !is_timer_pending (&stabbed->immortal))
 		{
-		  stabbed->immortal = IMMORTAL_DURATION;
+		  start_timer (&timers, &stabbed->immortal, IMMORTAL_DURATION);
 		  stabbed->life -= STAB_DAMAGE;
 
 		  if (stabbed->type == AGENT_PLAYER)
 		    {
-		      stabbed->data_ptr.player->freeze =
-			stabbed->data_ptr.player->id > i ? 4 : 5;
+		      start_timer (&timers, &stabbed->data_ptr.player->freeze,
+				   stabbed->data_ptr.player->id > i ? 4 : 5);
 		      stabbed->data_ptr.player->speed_x = speedx;
 		      stabbed->data_ptr.player->speed_y = speedy;
 		    }
 		  else
 		    {
-		      stabbed->data_ptr.zombie->freeze = 6;
+		      start_timer (&timers, &stabbed->data_ptr.zombie->freeze,
+				   6);
 		      stabbed->data_ptr.zombie->speed_x = speedx;
 		      stabbed->data_ptr.zombie->speed_y = speedy;
 		    }
 		}
 	    }
 
-	  if (players [i].agent->immortal)
-	    players [i].agent->immortal--;
-
-	  if (players [i].shoot_rest)
-	    players [i].shoot_rest--;
-
-	  if (players [i].stab_rest)
-	    players [i].stab_rest--;
-
-	  if (players [i].swap_rest)
-	    players [i].swap_rest--;
-
-	  if (players [i].hunger_up)
-	    players [i].hunger_up--;
-	  else
-	    {
-	      if (players [i].hunger < MAX_HUNGER)
-		players [i].hunger++;
-	      else
-		players [i].agent->life--;
-
-	      players [i].hunger_up = HUNGER_UP;
-	    }
-
-	  if (players [i].thirst_up)
-	    players [i].thirst_up--;
-	  else
-	    {
-	      if (players [i].thirst < MAX_THIRST)
-		players [i].thirst++;
-	      else
-		players [i].agent->life--;
-
-	      players [i].thirst_up = THIRST_UP;
-	    }
-
 	  w = players [i].agent->area->warps;
 
 	  while (w)
 	    {
 	      if (IS_RECT_CONTAINED (players [i].agent->place, w->place))
 		{
-		  players [i].agent->area = w->dest;
+		  par = NULL;
 
 		  if (w->dest->is_private)
 		    {
@@ -2276,17 +4336,14 @@ main (int argc, char *argv[])
 		      while (par)
 			{
 			  if (w->dest->id == par->id)
-			    {
-			      players [i].agent->private_area = par;
-			      break;
-			    }
+			    break;
 
 			  par = par->next;
 			}
 		    }
 
-		  players [i].agent->place.x = w->spawn.x;
-		  players [i].agent->place.y = w->spawn.y;
+		  warp_agent (players [i].agent, w->dest, par, w->spawn.x,
+			      w->spawn.y);
 		  break;
 		}
 
@@ -2313,11 +4370,11 @@ main (int argc, char *argv[])
 		      break;
 		    case OBJECT_FOOD:
 		      players [i].hunger = 0;
-		      players [i].hunger_up = HUNGER_UP;
+		      start_timer (&timers, &players [i].hunger_up, HUNGER_UP);
 		      break;
 		    case OBJECT_WATER:
 		      players [i].thirst = 0;
-		      players [i].thirst_up = THIRST_UP;
+		      start_timer (&timers, &players [i].thirst_up, THIRST_UP);
 		      break;
 		    case OBJECT_FLESH:
 		      for (j = 0; j < BAG_SIZE; j++)
@@ -2393,7 +4450,7 @@ main (int argc, char *argv[])
 		  || (players [i].might_search_at
 		      && players [i].might_search_at->searched_by == &players [i]
 		      && players [i].swap2 < BAG_SIZE*2))
-	      && !players [i].swap_rest)
+	      && !is_timer_pending (&players [i].swap_rest))
 	    {
 	      swap_objects (players [i].swap1 < BAG_SIZE
 			    ? &players [i].bag [players [i].swap1].type
@@ -2404,30 +4461,7 @@ main (int argc, char *argv[])
 			    : &players [i].might_search_at->content
 			    [players [i].swap2-BAG_SIZE].type);
 	      players [i].swap1 = players [i].swap2 = -1;
-	      players [i].swap_rest = 4;
-	    }
-	}
-
-      s = shots, prs = NULL;
-
-      while (s)
-	{
-	  s->duration--;
-
-	  if (!s->duration)
-	    {
-	      if (prs)
-		prs->next = s->next;
-	      else
-		shots = s->next;
-
-	      free (s);
-	      s = prs ? prs->next : shots;
-	    }
-	  else
-	    {
-	      prs = s;
-	      s = s->next;
+	      start_timer (&timers, &players [i].swap_rest, 4);
 	    }
 	}
 
@@ -2439,13 +4473,17 @@ main (int argc, char *argv[])
 
 	  while (z)
 	    {
-	      if (z->agent->life <= 0)
+	      if (z->agent->life <= 0
+		  || (z->agent->area != z->home
+		      && !get_zombie_target (z, players)))
 		{
-		  i = rand () % 20;
+		  i = z->agent->life <= 0
+		    ? get_random_below (&area->prng, 20) : 0;
 
 		  if (i && i <= 5)
 		    {
 		      obj = malloc_and_check (sizeof (*obj));
+		      obj->id = new_entity_id ();
 		      obj->area = area;
 		      obj->place = z->agent->place;
 		      obj->type = i;
@@ -2459,117 +4497,184 @@ main (int argc, char *argv[])
 		  else
 		    area->zombies = z->next;
 
-		  if (z->agent->prev)
-		    z->agent->prev->next = z->agent->next;
-		  else
-		    agents = z->agent->next;
-
-		  if (z->agent->next)
-		    z->agent->next->prev = z->agent->prev;
-
+		  stop_timer (&z->agent->immortal);
+		  stop_timer (&z->freeze);
+		  stop_timer (&z->next_thinking);
+		  remove_agent (z->agent);
+		  z->home->zombies_num--;
 		  free (z->agent);
 		  free (z);
 
-		  area->zombies_num--;
-
 		  z = prz ? prz->next : area->zombies;
 		}
 	      else
 		{
-		  z->agent->place = move_zombie (z->agent->place, area,
-						 z->speed_x, z->speed_y,
-						 area->walkable,
-						 area->full_obstacles,
-						 area->full_obstacles_num,
-						 area->half_obstacles,
-						 area->half_obstacles_num,
-						 players, z->type);
-
-		  prz = z;
-		  z = z->next;
+		  move_agent (z->agent,
+			      move_zombie (z->agent->place, z->speed_x,
+					   z->speed_y, area->walkable,
+					   &area->full_index,
+					   &area->half_index,
+					   &area->agents.grid, z->type,
+					   &timers));
+
+		  if (get_zombie_warp (z, players))
+		    {
+		      if (prz)
+			prz->next = z->next;
+		      else
+			area->zombies = z->next;
+
+		      z->next = warped;
+		      warped = z;
+		      z = prz ? prz->next : area->zombies;
+		    }
+		  else
+		    {
+		      prz = z;
+		      z = z->next;
+		    }
 		}
 	    }
 
 	  area = area->next;
 	}
 
+      while (warped)
+	{
+	  z = warped;
+	  warped = z->next;
+	  w = get_zombie_warp (z, players);
+	  warp_agent (z->agent, w->dest, NULL, w->spawn.x, w->spawn.y);
+	  z->is_following = 1;
+	  z->next = w->dest->zombies;
+	  w->dest->zombies = z;
+	}
+
       for (i = 0; i < MAX_PLAYERS; i++)
 	{
 	  if (players [i].id != -1 && players [i].agent->life <= 0)
 	    {
 	      printf ("player %s died\n", players [i].name);
-	      send_message (sockfd, &players [i].address, -1, MSG_PLAYER_DIED);
+	      reply.type = MSG_PLAYER_DIED;
+	      send_message (sockfd, &players [i].address, &reply);
+	      remove_session (&sessions, &players [i].address, i);
+	      stop_player_timers (&players [i]);
 	      players [i].id = -1;
 
 	      if (players [i].might_search_at
 		  && players [i].might_search_at->searched_by == &players [i])
 		players [i].might_search_at->searched_by = NULL;
 
-	      if (players [i].agent->prev)
-		players [i].agent->prev->next = players [i].agent->next;
-	      else
-		agents = players [i].agent->next;
-
-	      if (players [i].agent->next)
-		players [i].agent->next->prev = players [i].agent->prev;
-
+	      remove_agent (players [i].agent);
 	      free (players [i].agent);
-	    }
-	  else if (players [i].id != -1)
-	    {
-	      send_server_state (sockfd, frame_counter, i, players, agents,
-				 shots, objects);
-
-	      players [i].textbox = NULL;
-	      players [i].textbox_lines_num = 0;
+	      free (players [i].snapshots);
+	      free (players [i].priorities);
 	    }
 	}
 
+      snapjob.num_players = 0;
+
       for (i = 0; i < MAX_PLAYERS; i++)
 	{
-	  if (players [i].id != -1)
+	  if (players [i].id != -1 && should_send_snapshot (&players [i]))
+	    snapjob.ids [snapjob.num_players++] = i;
+	}
+
+      snapjob.frame_counter = frame_counter;
+      snapjob.players = players;
+      snapjob.timers = &timers;
+      build_aoi (&field, objects, shots, &timers);
+      run_jobs (&pool, snapjob.num_players, encode_server_state_job, &snapjob);
+
+      for (i = 0; i < num_workers; i++)
+	flush_datagrams (sockfd, &snapjob.workers [i].outbox);
+
+      for (i = 0; i < snapjob.num_players; i++)
+	{
+	  players [snapjob.ids [i]].textbox = NULL;
+	  players [snapjob.ids [i]].textbox_lines_num = 0;
+	}
+
+      if (!(frame_counter % RATE_WINDOW))
+	{
+	  for (i = 0; i < MAX_PLAYERS; i++)
 	    {
-	      if (players [i].freeze)
-		{
-		  players [i].freeze--;
+	      if (players [i].id != -1)
+		update_send_rate (&players [i]);
+	    }
+	}
 
-		  if (!players [i].freeze)
-		    {
-		      players [i].speed_x = players [i].speed_y = 0;
-		    }
-		}
+      frame_counter++;
+      advance_timer_wheel (&timers);
 
-	      players [i].timeout--;
+      while ((t = pop_expired_timer (&timers)))
+	{
+	  switch (t->kind)
+	    {
+	    case TIMER_PLAYER_FREEZE:
+	      pl = t->data;
+	      pl->speed_x = pl->speed_y = 0;
+	      break;
+	    case TIMER_ZOMBIE_FREEZE:
+	      z = t->data;
+	      z->speed_x = z->speed_y = 0;
+	      break;
+	    case TIMER_HUNGER:
+	      pl = t->data;
 
-	      if (!players [i].timeout)
-		{
-		  printf ("player %s disconnected due to timeout\n",
-			  players [i].name);
-		  players [i].id = -1;
+	      if (pl->hunger < MAX_HUNGER)
+		pl->hunger++;
+	      else
+		pl->agent->life--;
 
-		  if (players [i].might_search_at
-		      && players [i].might_search_at->searched_by == &players [i])
-		    players [i].might_search_at->searched_by = NULL;
+	      start_timer (&timers, t, HUNGER_UP);
+	      break;
+	    case TIMER_THIRST:
+	      pl = t->data;
 
-		  if (players [i].agent->prev)
-		    players [i].agent->prev->next = players [i].agent->next;
-		  else
-		    agents = players [i].agent->next;
+	      if (pl->thirst < MAX_THIRST)
+		pl->thirst++;
+	      else
+		pl->agent->life--;
 
-		  if (players [i].agent->next)
-		    players [i].agent->next->prev = players [i].agent->prev;
+	      start_timer (&timers, t, THIRST_UP);
+	      break;
+	    case TIMER_TIMEOUT:
+	      pl = t->data;
+	      printf ("player %s disconnected due to timeout\n", pl->name);
+	      remove_session (&sessions, &pl->address, pl->id);
+	      stop_player_timers (pl);
+	      pl->id = -1;
+
+	      if (pl->might_search_at
+		  && pl->might_search_at->searched_by == pl)
+		pl->might_search_at->searched_by = NULL;
+
+	      remove_agent (pl->agent);
+	      free (pl->agent);
+	      free (pl->snapshots);
+	      free (pl->priorities);
+	      break;
+	    case TIMER_SHOT:
+	      s = t->data;
+
+	      if (s == shots)
+		shots = s->next;
+	      else
+		{
+		  for (prs = shots; prs->next != s; prs = prs->next)
+		    ;
 
-		  free (players [i].agent);
+		  prs->next = s->next;
 		}
+
+	      free (s);
+	      break;
+	    default:
+	      break;
 	    }
 	}
 
-      zombie_spawn_counter++;
-
-      object_spawn_counter++;
-
-      frame_counter++;
-
 
       if (display_gui && t1-last_refresh > FRAME_DURATION)
 	{
@@ -2583,16 +4688,6 @@ main (int argc, char *argv[])
 	  SDL_RenderPresent (rend);
 	  last_refresh = t1;
 	}
-
-
-      t2 = SDL_GetTicks ();
-
-      delay = FRAME_DURATION - (t2 - t1);
-
-      if (delay > 0)
-	SDL_Delay (delay);
-      else
-	printf ("warning: frame skipped\n");
     }
 
   SDL_Quit ();
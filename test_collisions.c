@@ -0,0 +1,75 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+/* checks of slide_box.  It lives in server.c, which is included whole
+   with its main renamed */
+
+#define main server_main
+#include "server.c"
+#undef main
+
+
+
+int failures;
+
+
+void
+check_move (const char *what, SDL_Rect box, int speed_x, int speed_y,
+	    SDL_Rect obstacles [], int obstacles_num, int x, int y)
+{
+  SDL_Rect walkable = {0, 0, 256, 256};
+  struct obstacle_index full, half;
+  struct agent_set agents;
+  struct agent *touched [MAX_TOUCHED];
+  int touched_num;
+
+  init_obstacle_index (&full, obstacles, obstacles_num, walkable);
+  init_obstacle_index (&half, NULL, 0, walkable);
+  init_agent_set (&agents, walkable);
+
+  box = slide_box (box, speed_x, speed_y, &full, &half, &agents.grid,
+		   AGENT_ZOMBIE, touched, &touched_num);
+
+  if (box.x != x || box.y != y)
+    {
+      fprintf (stderr, "%s: box ended at %d,%d instead of %d,%d\n", what,
+	       box.x, box.y, x, y);
+      failures++;
+    }
+}
+
+
+int
+main (void)
+{
+  SDL_Rect box = {40, 40, 16, 16}, wall = {48, 32, 64, 64};
+
+  check_move ("stop at a wall", (SDL_Rect) {28, 40, 16, 16}, 8, 0, &wall, 1,
+	      32, 40);
+  check_move ("slide along a wall", (SDL_Rect) {28, 40, 16, 16}, 8, 4, &wall,
+	      1, 32, 44);
+  check_move ("start inside, move deeper", box, 4, 4, &wall, 1, 40, 40);
+  check_move ("start inside, move out", box, -4, 0, &wall, 1, 36, 40);
+  check_move ("start inside, move out upwards", box, 4, -4, &wall, 1, 40, 36);
+  check_move ("start inside, move out leftwards", box, -4, 4, &wall, 1, 36,
+	      40);
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "config.h"
+
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "timers.h"
+
+
+
+void
+init_timer_wheel (struct timer_wheel *w, uint32_t now)
+{
+  w->now = now;
+  memset (w->slots, 0, sizeof (w->slots));
+}
+
+
+void
+init_timer (struct timer *t, int kind, void *data)
+{
+  t->kind = kind;
+  t->data = data;
+  t->slot = NULL;
+}
+
+
+static void
+link_timer (struct timer_wheel *w, struct timer *t)
+{
+  uint32_t left = t->expires - w->now;
+  int level = 0;
+
+  while (level < TIMER_LEVELS-1 && left >> TIMER_LEVEL_BITS*(level+1))
+    level++;
+
+  t->slot = &w->slots [level][(t->expires >> TIMER_LEVEL_BITS*level)
+			      & (TIMER_LEVEL_SLOTS-1)];
+  t->prev = NULL;
+  t->next = *t->slot;
+
+  if (t->next)
+    t->next->prev = t;
+
+  *t->slot = t;
+}
+
+
+/* starts t so that it expires ticks ticks from now, but at least one and
+   at most MAX_TIMER_TICKS.  A pending t is started again */
+void
+start_timer (struct timer_wheel *w, struct timer *t, uint32_t ticks)
+{
+  stop_timer (t);
+
+  if (!ticks)
+    ticks = 1;
+  else if (ticks > MAX_TIMER_TICKS)
+    ticks = MAX_TIMER_TICKS;
+
+  t->expires = w->now + ticks;
+  link_timer (w, t);
+}
+
+
+void
+stop_timer (struct timer *t)
+{
+  if (!t->slot)
+    return;
+
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    *t->slot = t->next;
+
+  if (t->next)
+    t->next->prev = t->prev;
+
+  t->slot = NULL;
+}
+
+
+int
+is_timer_pending (const struct timer *t)
+{
+  return t->slot != NULL;
+}
+
+
+/* returns how many ticks are left before t expires, or 0 if it is not
+   pending */
+uint32_t
+get_timer_left (const struct timer_wheel *w, const struct timer *t)
+{
+  return t->slot ? t->expires - w->now : 0;
+}
+
+
+/* moves w to the next tick.  The timers that expire in it must then be
+   taken with pop_expired_timer until it returns NULL */
+void
+advance_timer_wheel (struct timer_wheel *w)
+{
+  struct timer *t, *next, **slot;
+  int level;
+
+  w->now++;
+
+  for (level = 1; level < TIMER_LEVELS
+	 && !(w->now & ((1u << TIMER_LEVEL_BITS*level) - 1)); level++)
+    {
+      slot = &w->slots [level][(w->now >> TIMER_LEVEL_BITS*level)
+			       & (TIMER_LEVEL_SLOTS-1)];
+      t = *slot;
+      *slot = NULL;
+
+      for (; t; t = next)
+	{
+	  next = t->next;
+	  link_timer (w, t);
+	}
+    }
+}
+
+
+/* returns a timer that expires now, no longer pending, or NULL.  Timers
+   stopped or started meanwhile are not returned */
+struct timer *
+pop_expired_timer (struct timer_wheel *w)
+{
+  struct timer *t = w->slots [0][w->now & (TIMER_LEVEL_SLOTS-1)];
+
+  if (t)
+    stop_timer (t);
+
+  return t;
+}
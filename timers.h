@@ -0,0 +1,70 @@
+/*  Copyright (C) 2026 Andrea Monaco
+ *
+ *  This file is part of zombieland, an MMO game.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+/* a wheel has TIMER_LEVELS levels of TIMER_LEVEL_SLOTS slots each, so
+   timers can expire at most MAX_TIMER_TICKS ticks from now */
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4
+#define MAX_TIMER_TICKS ((1 << TIMER_LEVEL_BITS*TIMER_LEVELS) - 1)
+
+
+
+/* a countdown that expires on tick expires of its wheel.  It is pending
+   from when it is started until it expires or is stopped, and meanwhile it
+   is in the list of slot.  kind and data are left to the caller */
+struct
+timer
+{
+  uint32_t expires;
+  int kind;
+  void *data;
+
+  struct timer **slot;
+  struct timer *prev;
+  struct timer *next;
+};
+
+
+/* the pending timers by expiry tick.  Level l has those expiring less
+   than TIMER_LEVEL_SLOTS to the l+1 ticks from now, in the slot given by
+   the l-th group of TIMER_LEVEL_BITS bits of expires.  Whenever the bits
+   of now below that group wrap, the slot of level l that now enters is
+   spread over the lower levels, so that a timer is only moved once per
+   level.  Expired timers are the ones in the level 0 slot of now */
+struct
+timer_wheel
+{
+  uint32_t now;
+  struct timer *slots [TIMER_LEVELS][TIMER_LEVEL_SLOTS];
+};
+
+
+
+void init_timer_wheel (struct timer_wheel *w, uint32_t now);
+void init_timer (struct timer *t, int kind, void *data);
+
+void start_timer (struct timer_wheel *w, struct timer *t, uint32_t ticks);
+void stop_timer (struct timer *t);
+int is_timer_pending (const struct timer *t);
+uint32_t get_timer_left (const struct timer_wheel *w, const struct timer *t);
+
+void advance_timer_wheel (struct timer_wheel *w);
+struct timer *pop_expired_timer (struct timer_wheel *w);
@@ -21,7 +21,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -31,54 +31,23 @@
 
 #include "zombieland.h"
 #include "malloc.h"
+#include "packet.h"
 
 
 
 void
-send_message (int sockfd, struct sockaddr_in *addr, uint16_t portoff,
-	      uint32_t type, ...)
+send_message (int sockfd, struct sockaddr_in *addr, const struct message *msg)
 {
-  struct message msg;
-  va_list valist;
+  unsigned char buf [MAX_PACKET_SIZE];
+  size_t len = encode_message (msg, NULL, buf, sizeof (buf));
 
-  bzero (&msg, sizeof (msg));
-
-  if (portoff != (uint16_t)-1)
-    addr->sin_port = htons (ZOMBIELAND_PORT+portoff);
-
-  msg.type = htonl (type);
-
-  switch (type)
+  if (!len)
     {
-    case MSG_CLIENT_CHAR_STATE:
-      va_start (valist, type);
-      msg.args.client_char_state.id = htonl (va_arg (valist, uint32_t));
-      msg.args.client_char_state.frame_counter = htonl (va_arg (valist, uint32_t));
-      msg.args.client_char_state.char_speed_x = htonl (va_arg (valist, int32_t));
-      msg.args.client_char_state.char_speed_y = htonl (va_arg (valist, int32_t));
-      msg.args.client_char_state.char_facing = htonl (va_arg (valist, enum facing));
-      msg.args.client_char_state.do_interact = va_arg (valist, uint32_t);
-      msg.args.client_char_state.do_shoot = va_arg (valist, uint32_t);
-      msg.args.client_char_state.do_stab = va_arg (valist, uint32_t);
-      msg.args.client_char_state.do_search = va_arg (valist, uint32_t);
-      msg.args.client_char_state.swap [0] = htonl (va_arg (valist, int32_t));
-      msg.args.client_char_state.swap [1] = htonl (va_arg (valist, int32_t));
-      va_end (valist);
-      break;
-    case MSG_SERVER_STATE:
-      va_start (valist, type);
-      msg.args.server_state.frame_counter = va_arg (valist, uint32_t);
-      msg.args.server_state.x = va_arg (valist, uint32_t);
-      msg.args.server_state.y = va_arg (valist, uint32_t);
-      msg.args.server_state.w = va_arg (valist, uint32_t);
-      msg.args.server_state.h = va_arg (valist, uint32_t);
-      msg.args.server_state.char_facing = va_arg (valist, enum facing);
-      va_end (valist);
-      break;
+      fprintf (stderr, "could not encode message of type %d\n", msg->type);
+      exit (1);
     }
 
-  if (sendto (sockfd, (char *)&msg, sizeof (msg), 0, (struct sockaddr *) addr,
-	      sizeof (*addr)) < 0)
+  if (sendto (sockfd, buf, len, 0, (struct sockaddr *) addr, sizeof (*addr)) < 0)
     {
       fprintf (stderr, "could not send data\n");
       exit (1);
@@ -39,6 +39,7 @@
 
 #define ZOMBIELAND_PORT 19894
 #define FRAME_DURATION 33.333f   /* 30 hz */
+#define FRAME_DURATION_NS 33333333L
 #define CLIENT_TIMEOUT 1800
 #define SERVER_TIMEOUT 60000
 #define MAXMSGSIZE 2048
@@ -95,12 +96,12 @@ zombie_type
 #define MSG_SERVER_STATE       5
 #define MSG_PLAYER_DIED        6
 #define MSG_INTERACT           7
+#define MSG_FRAGMENT           8
 
 
 struct
 login_args
 {
-  uint16_t portoff;
   char logname [MAX_LOGNAME_LEN+1];
   uint32_t bodytype;
 };
@@ -110,6 +111,7 @@ struct
 loginok_args
 {
   uint32_t id;
+  uint32_t token;
 };
 
 
@@ -117,7 +119,10 @@ struct
 client_char_state_args
 {
   uint32_t id;
+  uint32_t token;
   uint32_t frame_counter;
+  uint32_t ack_frame;
+  uint32_t received;
   int32_t char_speed_x, char_speed_y;
   enum facing char_facing;
   uint32_t do_interact;
@@ -139,9 +144,14 @@ client_char_state_args
 #define VISIBLE_SEARCHABLE 8
 #define VISIBLE_SEARCHING 9
 
+/* ids of visibles that are icons rather than entities */
+#define VISIBLE_ID_ICON 0x80000000
+#define VISIBLE_ID_SEARCHABLE VISIBLE_ID_ICON
+
 struct
 visible
 {
+  uint32_t id;
   uint32_t type;
   uint32_t subtype;
   uint32_t duration;
@@ -172,6 +182,7 @@ struct
 server_state_args
 {
   uint32_t frame_counter;
+  uint32_t baseline;
   uint32_t areaid;
   uint32_t x, y, w, h;
   enum facing char_facing;
@@ -192,6 +203,20 @@ server_state_args
 };
 
 
+/* the visibles of a snapshot, sorted by id.  Server and client keep the
+   last SNAPSHOT_HISTORY of them, indexed by frame, so that a new snapshot
+   can be sent as a difference from one the client acknowledged */
+#define SNAPSHOT_HISTORY 16
+
+struct
+snapshot
+{
+  uint32_t frame;
+  uint32_t num_visibles;
+  struct visible visibles [MAX_VISIBLES];
+};
+
+
 union
 args_union
 {
@@ -211,7 +236,7 @@ message
 
 
 
-void send_message (int sockfd, struct sockaddr_in *addr, uint16_t portoff,
-		   uint32_t type, ...);
+void send_message (int sockfd, struct sockaddr_in *addr,
+		   const struct message *msg);
 char *concatenate_strings (const char *s1, const char *s2);
 TTF_Font *load_font (const char *name, int size);